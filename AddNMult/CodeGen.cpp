@@ -1,5 +1,14 @@
 #include "CodeGen.h"
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <limits>
+#include <unordered_set>
+#include <llvm/IR/MDBuilder.h>
 #include <llvm/IR/Verifier.h>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/Path.h>
+#include <llvm/Transforms/Utils/ModuleUtils.h>
 
 using namespace addNMult;
 using llvm::BasicBlock;
@@ -12,42 +21,119 @@ static llvm::Type* i64Ty(llvm::LLVMContext& ctx) {
     return llvm::Type::getInt64Ty(ctx);
 }
 
-CodeGen::CodeGen(const std::string& moduleName) {
+// Profile files are a magic number, the number of counters, and then the
+// counters themselves, all as native 64-bit integers.
+static constexpr std::uint64_t profileMagic = 0x31464f52504d4e41; // "ANMPROF1"
+
+CodeGen::CodeGen(const std::string& moduleName, CodeGenOptions options)
+    : ownedCtx(std::make_unique<llvm::LLVMContext>()), ctx(*ownedCtx), opts(options) {
     mod = std::make_unique<Module>(moduleName, ctx);
     mod->setSourceFileName("addNMult.cpp");
     builder = std::make_unique<llvm::IRBuilder<>>(ctx);
 }
 
+std::pair<std::unique_ptr<llvm::LLVMContext>, std::unique_ptr<Module>> CodeGen::release() {
+    dib.reset();
+    builder.reset();
+    return {std::move(ownedCtx), std::move(mod)};
+}
+
+// A post-order walk over an explicit stack, so that a left-deep chain of
+// a million additions needs no more native stack than a single one. A
+// binary expression is visited twice: first to schedule its operands, and
+// again, once their values are on top of `values`, to combine them.
 Value* CodeGen::codegen(const Expression* e) {
+    std::vector<std::pair<const Expression*, bool>> work{{e, false}};
+    std::vector<Value*> values;
+    while (!work.empty()) {
+        auto [at, operandsDone] = work.back();
+        work.pop_back();
+
+        auto* bin = dynamic_cast<const BinaryExpression*>(at);
+        if (!bin) {
+            Value* leaf = codegenLeaf(at);
+            if (!leaf) return nullptr;
+            values.push_back(leaf);
+        } else if (!operandsDone) {
+            work.emplace_back(bin, true);
+            work.emplace_back(bin->rhs.get(), false);
+            work.emplace_back(bin->lhs.get(), false);
+        } else {
+            Value* R = values.back();
+            values.pop_back();
+            Value* L = values.back();
+            values.pop_back();
+            values.push_back(binary(bin->op, L, R));
+        }
+    }
+    return values.back();
+}
+
+Value* CodeGen::codegenLeaf(const Expression* e) {
     if (!e) return nullptr;
     if (auto n = dynamic_cast<const NumberExpression*>(e)) return codegenNumber(n);
     if (auto v = dynamic_cast<const VarExpression*>(e))    return codegenVar(v);
     if (auto b = dynamic_cast<const BoolExpression*>(e))   return codegenBool(b);
-    if (auto bin = dynamic_cast<const BinaryExpression*>(e)) return codegenBinary(bin);
     return nullptr;
 }
 
 Value* CodeGen::codegenNumber(const NumberExpression* e) {
-    return ConstantInt::get(i64Ty(ctx), e->value, false);
+    return number(e->value);
 }
 
 Value* CodeGen::codegenVar(const VarExpression* e) {
-    auto it = named.find(e->name);
-    if (it == named.end()) return nullptr;
-    return builder->CreateLoad(i64Ty(ctx), it->second, e->name.c_str());
+    return variable(e->name);
 }
 
 Value* CodeGen::codegenBool(const BoolExpression* e) {
-    return ConstantInt::get(i64Ty(ctx), e->value ? 1 : 0, false);
+    return boolean(e->value);
+}
+
+Value* CodeGen::number(std::uint64_t value) {
+    return ConstantInt::get(i64Ty(ctx), value, false);
+}
+
+Value* CodeGen::boolean(bool value) {
+    return ConstantInt::get(i64Ty(ctx), value ? 1 : 0, false);
 }
 
-Value* CodeGen::codegenBinary(const BinaryExpression* e) {
-    Value* L = codegen(e->lhs.get());
-    if (!L) return nullptr;
-    Value* R = codegen(e->rhs.get());
-    if (!R) return nullptr;
+Value* CodeGen::variable(const std::string& name) {
+    Value* slot = lookup(name);
+    if (!slot) return nullptr;
+    if (opts.ssa) return slot;
+    if (!reusing()) return builder->CreateLoad(i64Ty(ctx), slot, name.c_str());
 
-    switch (e->op) {
+    Value*& value = loaded[name];
+    if (!value) value = builder->CreateLoad(i64Ty(ctx), slot, name.c_str());
+    return value;
+}
+
+// Whether values can be reused, starting afresh whenever emission has
+// moved on to another block: what was computed in one block need not
+// dominate the next.
+bool CodeGen::reusing() {
+    if (!opts.reuseValues) return false;
+    if (builder->GetInsertBlock() != reuseBlock) {
+        reuseBlock = builder->GetInsertBlock();
+        loaded.clear();
+        computed.clear();
+    }
+    return true;
+}
+
+Value* CodeGen::lookup(const std::string& name) {
+    return lookupAt(arms.size(), name);
+}
+
+Value* CodeGen::binary(Op op, Value* L, Value* R) {
+    if (!reusing()) return emitBinary(op, L, R);
+    Value*& value = computed[{op, L, R}];
+    if (!value) value = emitBinary(op, L, R);
+    return value;
+}
+
+Value* CodeGen::emitBinary(Op op, Value* L, Value* R) {
+    switch (op) {
         case Op::Add:
             return builder->CreateAdd(L, R, "addval");
         case Op::Mul:
@@ -80,105 +166,767 @@ Value* CodeGen::codegenBinary(const BinaryExpression* e) {
     return nullptr;
 }
 
+void CodeGen::setSource(const std::string& fileName, const LineTable& lineTable,
+                        bool full) {
+    sourceName = fileName;
+    lines = &lineTable;
+    fullDebugInfo = full;
+}
+
+void CodeGen::setLocation(std::size_t offset) {
+    if (!subprogram) return;
+    builder->SetCurrentDebugLocation(llvm::DILocation::get(
+        ctx, lines->line(offset), lines->column(offset), subprogram
+    ));
+}
+
 llvm::Function* CodeGen::emit(const Program& program) {
+    if (!begin()) return nullptr;
+    for (const auto& stmtPtr : program.statements) {
+        if (!emitStatement(stmtPtr.get())) {
+            discard();
+            return nullptr;
+        }
+    }
+    return finish();
+}
+
+bool CodeGen::begin() {
     named.clear();
+    openIfs.clear();
+    debugVars.clear();
+    environment = {};
+    reuseBlock = nullptr;
+    arms.clear();
+    outlined.clear();
+    returnSlot = nullptr;
+    numCounters = 0;
+    counterArrays.clear();
+    weighted.clear();
+    if (!opts.profileUse.empty() && !loadProfile()) return false;
+
     auto* functionType = llvm::FunctionType::get(i64Ty(ctx), false);
-    auto* function = llvm::Function::Create(
+    function = llvm::Function::Create(
         functionType, llvm::Function::ExternalLinkage, "addNMult", mod.get()
     );
 
     auto* entryBlock = llvm::BasicBlock::Create(ctx, "entry", function);
     builder->SetInsertPoint(entryBlock);
-    for (const auto& stmtPtr : program.statements) {
-        if (!emitStatement(stmtPtr.get(), function)) {
-            function->eraseFromParent();
-            return nullptr;
+
+    if (lines) {
+        if (!dib) {
+            dib = std::make_unique<llvm::DIBuilder>(*mod);
+            // Relative paths are resolved against the working directory,
+            // so perf and gdb can find the source from anywhere.
+            llvm::SmallString<256> directory(llvm::sys::path::parent_path(sourceName));
+            llvm::sys::fs::make_absolute(directory);
+            auto* file = dib->createFile(
+                llvm::sys::path::filename(sourceName), directory
+            );
+            compileUnit = dib->createCompileUnit(
+                llvm::dwarf::DW_LANG_C, file, "addnmult", false, "", 0, "",
+                fullDebugInfo ? llvm::DICompileUnit::FullDebug
+                              : llvm::DICompileUnit::LineTablesOnly
+            );
+            if (fullDebugInfo) {
+                debugI64 = dib->createBasicType("i64", 64, llvm::dwarf::DW_ATE_signed);
+            }
+            mod->addModuleFlag(llvm::Module::Warning, "Debug Info Version",
+                               llvm::DEBUG_METADATA_VERSION);
+            mod->addModuleFlag(llvm::Module::Warning, "Dwarf Version", 4);
         }
+        describeFunction(1, debugI64);
+        setLocation(0);
+    }
+    if (opts.outlineArms) {
+        environment.slots = builder->CreateAlloca(i64Ty(ctx), builder->getInt32(0), "env");
+    }
+    return true;
+}
+
+// Gives the function being emitted a subprogram starting at `line`, and
+// makes it the scope of the locations that follow.
+void CodeGen::describeFunction(unsigned line, llvm::DIType* result) {
+    auto* file = compileUnit->getFile();
+    llvm::SmallVector<llvm::Metadata*, 1> signature;
+    if (result) signature.push_back(result);
+    subprogram = dib->createFunction(
+        file, function->getName(), function->getName(), file, line,
+        dib->createSubroutineType(dib->getOrCreateTypeArray(signature)), line,
+        llvm::DINode::FlagPrototyped, llvm::DISubprogram::SPFlagDefinition
+    );
+    function->setSubprogram(subprogram);
+}
+
+llvm::Function* CodeGen::finish() {
+    if (!opts.profileUse.empty() && !checkProfile()) {
+        discard();
+        return nullptr;
+    }
+    if (!opts.profileGenerate.empty()) emitProfileDump();
+    if (dib) {
+        builder->SetCurrentDebugLocation(llvm::DebugLoc());
+        subprogram = nullptr;
+        dib->finalize();
     }
     if (llvm::verifyFunction(*function, &llvm::errs())) {
-        function->eraseFromParent();
+        discard();
         return nullptr;
     }
+    for (auto* arm : outlined) {
+        if (llvm::verifyFunction(*arm, &llvm::errs())) {
+            discard();
+            return nullptr;
+        }
+    }
+
+    Function* result = function;
+    function = nullptr;
+    return result;
+}
 
-    return function;
+void CodeGen::discard() {
+    if (!function) return;
+    if (!arms.empty()) function = arms.front().callBlock->getParent();
+    arms.clear();
+
+    // Bodies first: addNMult and the arms call arms.
+    function->dropAllReferences();
+    for (auto* arm : outlined) arm->dropAllReferences();
+    function->eraseFromParent();
+    for (auto* arm : outlined) arm->eraseFromParent();
+    outlined.clear();
+    function = nullptr;
+    subprogram = nullptr;
 }
 
-bool CodeGen::emitStatement(const Statement* s, Function* function) {
+bool CodeGen::emitStatement(const Statement* s) {
+    setLocation(s->offset);
     if (auto* vd = dynamic_cast<const VarDecl*>(s)) {
-        auto* slot = builder->CreateAlloca(i64Ty(ctx), nullptr, vd->name);
-        named[vd->name] = slot;
         Value* init = codegen(vd->value.get());
         if (!init) return false;
-        builder->CreateStore(init, slot);
-        return true;
+        return declareVar(vd->name, init);
     }
 
     if (auto* st = dynamic_cast<const SetStatement*>(s)) {
-        auto it = named.find(st->name);
-        if (it == named.end()) return false;
         Value* v = codegen(st->value.get());
         if (!v) return false;
-        builder->CreateStore(v, it->second);
-        return true;
+        return assignVar(st->name, v);
     }
 
     if (auto* iff = dynamic_cast<const IfStatement*>(s)) {
-        return emitIf(*iff, function);
+        return emitIf(*iff);
     }
 
     if (auto* ret = dynamic_cast<const ReturnStatement*>(s)) {
         Value* v = codegen(ret->value.get());
         if (!v) return false;
-        builder->CreateRet(v);
+        returnValue(v);
         return true;
     }
 
     return false;
 }
 
-bool CodeGen::emitIf(const IfStatement& s, Function* function) {
+bool CodeGen::emitIf(const IfStatement& s) {
+    CaseChain chain = caseChain(s);
+    if (chain.cases.size() >= 2) return emitSwitch(chain);
+
     Value* cond = codegen(s.cond.get());
     if (!cond) return false;
 
+    beginIf(cond);
+    for (const auto& stmtPtr : s.thenBody) {
+        if (!emitStatement(stmtPtr.get())) return false;
+    }
+    if (!s.elseBody.empty()) {
+        beginElse();
+        for (const auto& stmtPtr : s.elseBody) {
+            if (!emitStatement(stmtPtr.get())) return false;
+        }
+    }
+    endIf();
+    return true;
+}
+
+// Whether `cond` is `variable == constant` or `constant == variable`.
+static bool caseTest(const Expression* cond, const VarExpression*& var,
+                     std::uint64_t& value) {
+    auto* eq = dynamic_cast<const BinaryExpression*>(cond);
+    if (!eq || eq->op != Op::Equal) return false;
+    auto* v = dynamic_cast<const VarExpression*>(eq->lhs.get());
+    auto* n = dynamic_cast<const NumberExpression*>(eq->rhs.get());
+    if (!v || !n) {
+        v = dynamic_cast<const VarExpression*>(eq->rhs.get());
+        n = dynamic_cast<const NumberExpression*>(eq->lhs.get());
+    }
+    if (!v || !n) return false;
+    var = v;
+    value = n->value;
+    return true;
+}
+
+// Follows else bodies that consist of nothing but the next if for as long
+// as the ifs test the same variable. A constant tested a second time ends
+// the chain there; its arm could never run, and a switch case is unique.
+CodeGen::CaseChain CodeGen::caseChain(const IfStatement& s) {
+    CaseChain chain;
+    std::unordered_set<std::uint64_t> seen;
+    for (const IfStatement* at = &s; at;) {
+        const VarExpression* var;
+        std::uint64_t value;
+        if (!caseTest(at->cond.get(), var, value)) break;
+        if (chain.var && var->name != chain.var->name) break;
+        if (!seen.insert(value).second) break;
+
+        chain.var = var;
+        chain.cases.emplace_back(value, at);
+        chain.defaultBody = &at->elseBody;
+        if (at->elseBody.size() != 1) break;
+        at = dynamic_cast<const IfStatement*>(at->elseBody.front().get());
+    }
+    return chain;
+}
+
+// Dispatches on the variable with a single switch, which the backend
+// turns into a jump table or a binary search instead of one compare and
+// branch per if. Each case, and the default, is an arm of one OpenIf, so
+// SSA merging, outlining and profiling treat it like an if with more
+// arms. Profile counters are numbered like the switch's successors,
+// default first.
+bool CodeGen::emitSwitch(const CaseChain& chain) {
+    Value* value = variable(chain.var->name);
+    if (!value) return false;
+
+    BranchSite site = newBranchSite(chain.cases.size() + 1);
+    BasicBlock* contBlock = BasicBlock::Create(ctx, "switchcont", function);
+    // With nothing to run or count, no match goes straight on.
+    bool defaultArm = !chain.defaultBody->empty() || site.counters;
+    BasicBlock* defaultBlock =
+        defaultArm ? BasicBlock::Create(ctx, "default", function) : contBlock;
+
+    auto* dispatch = builder->CreateSwitch(value, defaultBlock, chain.cases.size());
+    setBranchWeights(dispatch, site);
+    OpenIf open;
+    open.branch = dispatch;
+    open.contBlock = contBlock;
+    if (!defaultArm && opts.ssa) {
+        open.incoming.emplace_back(dispatch->getParent(), Definitions());
+    }
+    openIfs.push_back(std::move(open));
+
+    unsigned successor = 1;
+    for (const auto& [constant, statement] : chain.cases) {
+        setLocation(statement->offset);
+        auto* caseBlock = BasicBlock::Create(ctx, "case", function);
+        dispatch->addCase(ConstantInt::get(llvm::cast<llvm::IntegerType>(i64Ty(ctx)),
+                                           constant, false),
+                          caseBlock);
+        builder->SetInsertPoint(caseBlock);
+        if (site.counters) countBranch(site, builder->getInt64(successor));
+        successor++;
+        if (!emitArm(caseBlock, "case", statement->thenBody)) return false;
+    }
+    if (defaultArm) {
+        builder->SetInsertPoint(defaultBlock);
+        if (site.counters) countBranch(site, builder->getInt64(0));
+        if (!emitArm(defaultBlock, "default", *chain.defaultBody)) return false;
+    }
+
+    open = std::move(openIfs.back());
+    openIfs.pop_back();
+    builder->SetInsertPoint(contBlock);
+    if (opts.ssa) mergeDefinitions(open);
+    return true;
+}
+
+// Emits one arm of the innermost OpenIf starting at `block`, the insert
+// point, and leaves it for the next.
+bool CodeGen::emitArm(BasicBlock* block, const char* kind,
+                      const std::vector<std::unique_ptr<Statement>>& body) {
+    if (opts.outlineArms) beginArm(block, kind);
+    for (const auto& stmtPtr : body) {
+        if (!emitStatement(stmtPtr.get())) return false;
+    }
+    closeArm(openIfs.back());
+    return true;
+}
+
+bool CodeGen::declareVar(const std::string& name, Value* init) {
+    if (opts.opaqueLets && llvm::isa<ConstantInt>(init)) {
+        auto* input = new llvm::GlobalVariable(
+            *mod, i64Ty(ctx), false, llvm::GlobalValue::InternalLinkage,
+            llvm::cast<ConstantInt>(init), name + ".input"
+        );
+        init = builder->CreateLoad(i64Ty(ctx), input, true, name + ".input");
+    }
+    if (opts.ssa) {
+        named[name] = init;
+        if (!openIfs.empty()) openIfs.back().declared.push_back(name);
+        describeVar(name, init, true);
+        return true;
+    }
+    auto* slot = opts.outlineArms ? entryAlloca(i64Ty(ctx), name)
+                                  : builder->CreateAlloca(i64Ty(ctx), nullptr, name);
+    named[name] = slot;
+    loaded.erase(name);
+    describeVar(name, slot, true);
+    builder->CreateStore(init, slot);
+    return true;
+}
+
+bool CodeGen::assignVar(const std::string& name, Value* value) {
+    Value* slot = lookup(name);
+    if (!slot) return false;
+    if (opts.ssa) {
+        rebind(name, value);
+        describeVar(name, value, false);
+        return true;
+    }
+    builder->CreateStore(value, slot);
+    loaded.erase(name);
+    return true;
+}
+
+// With full debug info, tell the debugger where a variable lives: its
+// stack slot, declared once, or in SSA mode each new value it takes.
+void CodeGen::describeVar(const std::string& name, Value* value, bool declaration) {
+    if (!subprogram || !debugI64) return;
+    const llvm::DILocation* loc = builder->getCurrentDebugLocation();
+    if (declaration) {
+        debugVars[name] = dib->createAutoVariable(
+            subprogram, name, compileUnit->getFile(), loc->getLine(), debugI64
+        );
+        if (!opts.ssa) {
+            dib->insertDeclare(value, debugVars[name], dib->createExpression(), loc,
+                               builder->GetInsertBlock());
+            return;
+        }
+    }
+    dib->insertDbgValueIntrinsic(value, debugVars[name], dib->createExpression(), loc,
+                                 builder->GetInsertBlock());
+}
+
+void CodeGen::returnValue(Value* value) {
+    if (arms.empty()) {
+        builder->CreateRet(value);
+        return;
+    }
+    // Inside an outlined arm, leave the value for addNMult to return.
+    builder->CreateStore(value, function->getArg(1));
+    builder->CreateRet(llvm::ConstantInt::getTrue(ctx));
+}
+
+void CodeGen::beginIf(Value* cond) {
     cond = builder->CreateICmpNE(
         cond,
         ConstantInt::get(i64Ty(ctx), 0, false),
         "ifcond"
     );
 
+    BranchSite site = newBranchSite(2);
+    if (site.counters) {
+        countBranch(site, builder->CreateSelect(
+            cond,
+            ConstantInt::get(i64Ty(ctx), 0, false),
+            ConstantInt::get(i64Ty(ctx), 1, false),
+            "ifsucc"
+        ));
+    }
+
     BasicBlock* thenBlock = BasicBlock::Create(ctx, "then", function);
-    BasicBlock* elseBlock = nullptr;
     BasicBlock* contBlock = BasicBlock::Create(ctx, "ifcont", function);
 
-    bool hasElse = !s.elseBody.empty();
-    if (hasElse) {
-        elseBlock = BasicBlock::Create(ctx, "else", function);
-        builder->CreateCondBr(cond, thenBlock, elseBlock);
+    // The false edge goes straight to ifcont until beginElse() gives the if
+    // an else arm; a single-pass parser only finds that out after the then
+    // arm has been emitted.
+    OpenIf open;
+    open.branch = builder->CreateCondBr(cond, thenBlock, contBlock);
+    open.contBlock = contBlock;
+    setBranchWeights(open.branch, site);
+    openIfs.push_back(std::move(open));
+
+    builder->SetInsertPoint(thenBlock);
+    if (opts.outlineArms) beginArm(thenBlock, "then");
+}
+
+void CodeGen::beginElse() {
+    OpenIf& open = openIfs.back();
+    closeArm(open);
+
+    BasicBlock* elseBlock = BasicBlock::Create(ctx, "else", function);
+    llvm::cast<llvm::BranchInst>(open.branch)->setSuccessor(1, elseBlock);
+    open.inElse = true;
+    builder->SetInsertPoint(elseBlock);
+    if (opts.outlineArms) beginArm(elseBlock, "else");
+}
+
+void CodeGen::endIf() {
+    OpenIf open = std::move(openIfs.back());
+    openIfs.pop_back();
+    closeArm(open);
+
+    if (!open.inElse && opts.ssa) {
+        open.incoming.emplace(open.incoming.begin(), open.branch->getParent(), Definitions());
+    }
+    builder->SetInsertPoint(open.contBlock);
+    if (opts.ssa) mergeDefinitions(open);
+}
+
+void CodeGen::closeArm(OpenIf& open) {
+    if (opts.outlineArms) endArm(open.contBlock);
+    BasicBlock* armEnd = builder->GetInsertBlock();
+    if (!armEnd->getTerminator()) {
+        builder->CreateBr(open.contBlock);
+        if (opts.ssa) {
+            Definitions defs;
+            for (const auto& entry : open.saved) defs[entry.first] = named[entry.first];
+            open.incoming.emplace_back(armEnd, std::move(defs));
+        }
+    }
+
+    // The next arm, or the code after the if, starts from the definitions
+    // at the branch, and the arm's own variables are out of scope.
+    if (opts.ssa) {
+        for (const auto& [name, value] : open.saved) named[name] = value;
+        for (const auto& name : open.declared) named.erase(name);
+        open.declared.clear();
+    }
+}
+
+// Starts emitting an arm into a new function, which the enclosing one
+// will call from `callBlock` once the arm is complete.
+void CodeGen::beginArm(BasicBlock* callBlock, const char* kind) {
+    auto* i64PtrTy = i64Ty(ctx)->getPointerTo();
+    auto* armType = llvm::FunctionType::get(
+        llvm::Type::getInt1Ty(ctx), {i64PtrTy, i64PtrTy}, false
+    );
+    // The lazy JIT compiles only external functions on their own, so the
+    // arm is external but hidden. Inlining it back into its caller would
+    // compile it along with the caller.
+    auto* arm = Function::Create(
+        armType, llvm::Function::ExternalLinkage,
+        function->getName() + "." + kind, mod.get()
+    );
+    arm->setVisibility(llvm::GlobalValue::HiddenVisibility);
+    arm->addFnAttr(llvm::Attribute::NoInline);
+    arm->getArg(0)->setName("outerenv");
+    arm->getArg(1)->setName("retslot");
+    outlined.push_back(arm);
+
+    OutlinedArm open{arm, callBlock, {}, std::move(named), std::move(environment),
+                     subprogram, builder->getCurrentDebugLocation()};
+    arms.push_back(std::move(open));
+    named.clear();
+    environment = {};
+    function = arm;
+    builder->SetInsertPoint(BasicBlock::Create(ctx, "entry", arm));
+
+    if (subprogram) {
+        const llvm::DebugLoc& at = arms.back().outerLocation;
+        describeFunction(at.getLine(), nullptr);
+        builder->SetCurrentDebugLocation(
+            llvm::DILocation::get(ctx, at.getLine(), at.getCol(), subprogram));
+    }
+    environment.slots = builder->CreateAlloca(i64Ty(ctx), builder->getInt32(0), "env");
+}
+
+// Finishes the innermost outlined arm and calls it from the enclosing
+// function, which returns too if the arm did and otherwise carries on
+// at `contBlock`.
+void CodeGen::endArm(BasicBlock* contBlock) {
+    OutlinedArm arm = std::move(arms.back());
+    arms.pop_back();
+    if (!builder->GetInsertBlock()->getTerminator()) {
+        for (const auto& name : arm.captured) {
+            builder->CreateStore(
+                builder->CreateLoad(i64Ty(ctx), named[name], name),
+                builder->CreateConstInBoundsGEP1_32(
+                    i64Ty(ctx), arm.function->getArg(0), arm.outerEnvironment.index[name]));
+        }
+        builder->CreateRet(llvm::ConstantInt::getFalse(ctx));
+    }
+
+    named = std::move(arm.outerNamed);
+    environment = std::move(arm.outerEnvironment);
+    function = arm.callBlock->getParent();
+    subprogram = arm.outerSubprogram;
+    builder->SetInsertPoint(arm.callBlock);
+    builder->SetCurrentDebugLocation(arm.outerLocation);
+
+    Value* slot;
+    if (arms.empty()) {
+        if (!returnSlot) returnSlot = entryAlloca(i64Ty(ctx), "retslot");
+        slot = returnSlot;
     } else {
-        builder->CreateCondBr(cond, thenBlock, contBlock);
+        slot = function->getArg(1);
     }
 
-    builder->SetInsertPoint(thenBlock);
-    for (const auto& stmtPtr : s.thenBody) {
-        if (!emitStatement(stmtPtr.get(), function)) return false;
+    auto environmentSlot = [&](const std::string& name) {
+        return builder->CreateConstInBoundsGEP1_32(
+            i64Ty(ctx), environment.slots, environment.index[name]);
+    };
+    for (const auto& name : arm.captured) {
+        builder->CreateStore(builder->CreateLoad(i64Ty(ctx), named[name], name),
+                             environmentSlot(name));
     }
-    
-    BasicBlock* thenEnd = builder->GetInsertBlock();
-    if (!thenEnd->getTerminator()) {
-        builder->CreateBr(contBlock);
+    Value* returned = builder->CreateCall(
+        arm.function, {environment.slots, slot}, "returned");
+    for (const auto& name : arm.captured) {
+        builder->CreateStore(builder->CreateLoad(i64Ty(ctx), environmentSlot(name), name),
+                             named[name]);
     }
 
-    if (hasElse) {
-        builder->SetInsertPoint(elseBlock);
-        for (const auto& stmtPtr : s.elseBody) {
-            if (!emitStatement(stmtPtr.get(), function)) return false;
+    if (!environment.returnBlock) {
+        environment.returnBlock = BasicBlock::Create(ctx, "armret", function);
+        llvm::IRBuilder<> ret(environment.returnBlock);
+        ret.SetCurrentDebugLocation(builder->getCurrentDebugLocation());
+        if (arms.empty()) {
+            ret.CreateRet(ret.CreateLoad(i64Ty(ctx), slot, "retval"));
+        } else {
+            ret.CreateRet(llvm::ConstantInt::getTrue(ctx));
+        }
+    }
+    builder->CreateCondBr(returned, environment.returnBlock, contBlock);
+}
+
+// Allocas outside the entry block are dynamic, which the optimizer
+// handles far less well. They go after the environment, which comes
+// first so that arms can copy captured variables out of it on entry.
+llvm::AllocaInst* CodeGen::entryAlloca(llvm::Type* type, const llvm::Twine& name) {
+    llvm::IRBuilder<> atEntry(environment.slots->getParent(),
+                              std::next(environment.slots->getIterator()));
+    return atEntry.CreateAlloca(type, nullptr, name);
+}
+
+// The slot of a variable in the function `level` arms deep (addNMult
+// being level 0), captured from the functions around it if need be.
+Value* CodeGen::lookupAt(std::size_t level, const std::string& name) {
+    Definitions& names = level == arms.size() ? named : arms[level].outerNamed;
+    auto it = names.find(name);
+    if (it != names.end()) return it->second;
+    return level == 0 ? nullptr : capture(level, name);
+}
+
+// Gives an outer variable that an arm mentions for the first time a slot
+// in its caller's environment, and a variable in the arm initialized
+// from that slot.
+Value* CodeGen::capture(std::size_t level, const std::string& name) {
+    if (!lookupAt(level - 1, name)) return nullptr;
+
+    OutlinedArm& arm = arms[level - 1];
+    Environment& outer = arm.outerEnvironment;
+    auto [entry, added] = outer.index.try_emplace(name, outer.index.size());
+    if (added) outer.slots->setOperand(0, builder->getInt32(outer.index.size()));
+    arm.captured.push_back(name);
+
+    Environment& own = level == arms.size() ? environment : arms[level].outerEnvironment;
+    llvm::IRBuilder<> atEntry(own.slots->getParent(), std::next(own.slots->getIterator()));
+    auto* slot = atEntry.CreateAlloca(i64Ty(ctx), nullptr, name);
+    atEntry.CreateStore(
+        atEntry.CreateLoad(i64Ty(ctx), atEntry.CreateConstInBoundsGEP1_32(
+            i64Ty(ctx), arm.function->getArg(0), entry->second), name),
+        slot);
+    Definitions& names = level == arms.size() ? named : arms[level].outerNamed;
+    names[name] = slot;
+    return slot;
+}
+
+void CodeGen::rebind(const std::string& name, Value* value) {
+    Value*& current = named[name];
+    if (!openIfs.empty()) {
+        OpenIf& open = openIfs.back();
+        bool local = std::find(open.declared.begin(), open.declared.end(), name)
+                     != open.declared.end();
+        if (!local) open.saved.try_emplace(name, current);
+    }
+    current = value;
+}
+
+void CodeGen::mergeDefinitions(OpenIf& open) {
+    if (open.incoming.empty()) return;
+
+    // An arm that left a variable alone passes on its definition at the
+    // branch, which is what was saved when the other arm reassigned it.
+    // Debug values are described after the last phi.
+    std::vector<std::pair<std::string, Value*>> merged;
+    for (const auto& [name, atBranch] : open.saved) {
+        auto incomingValue = [&](const Definitions& defs) {
+            auto it = defs.find(name);
+            return it == defs.end() ? atBranch : it->second;
+        };
+
+        Value* first = incomingValue(open.incoming.front().second);
+        bool same = true;
+        for (const auto& [pred, defs] : open.incoming) {
+            if (incomingValue(defs) != first) {
+                same = false;
+                break;
+            }
+        }
+        if (same) {
+            rebind(name, first);
+            merged.emplace_back(name, first);
+            continue;
         }
-        BasicBlock* elseEnd = builder->GetInsertBlock();
-        if (!elseEnd->getTerminator()) {
-            builder->CreateBr(contBlock);
+
+        auto* phi = builder->CreatePHI(i64Ty(ctx), open.incoming.size(), name);
+        for (const auto& [pred, defs] : open.incoming) {
+            phi->addIncoming(incomingValue(defs), pred);
         }
+        rebind(name, phi);
+        merged.emplace_back(name, phi);
     }
+    for (const auto& [name, value] : merged) describeVar(name, value, false);
+}
 
-    builder->SetInsertPoint(contBlock);
+CodeGen::BranchSite CodeGen::newBranchSite(unsigned successors) {
+    BranchSite site{numCounters, successors, nullptr};
+    numCounters += successors;
+    if (!opts.profileGenerate.empty()) {
+        auto* arrayTy = llvm::ArrayType::get(i64Ty(ctx), successors);
+        site.counters = new llvm::GlobalVariable(
+            *mod, arrayTy, false, llvm::GlobalValue::InternalLinkage,
+            llvm::ConstantAggregateZero::get(arrayTy), "__addnmult_prof_counters"
+        );
+        counterArrays.push_back(site.counters);
+    }
+    return site;
+}
+
+void CodeGen::countBranch(const BranchSite& site, Value* successor) {
+    Value* slot = builder->CreateInBoundsGEP(
+        site.counters->getValueType(), site.counters,
+        {ConstantInt::get(i64Ty(ctx), 0, false), successor}, "profslot"
+    );
+    Value* count = builder->CreateLoad(i64Ty(ctx), slot, "profcount");
+    builder->CreateStore(
+        builder->CreateAdd(count, ConstantInt::get(i64Ty(ctx), 1, false)), slot
+    );
+}
+
+void CodeGen::setBranchWeights(llvm::Instruction* branch, const BranchSite& site) {
+    if (opts.profileUse.empty()) return;
+    if (site.firstCounter + site.successors > profile.size()) return;
+
+    // Branch weights are 32-bit, so scale the counts down the way clang does
+    // for its own instrumentation profiles.
+    std::uint64_t max = 0;
+    for (unsigned i = 0; i < site.successors; i++) {
+        max = std::max(max, profile[site.firstCounter + i]);
+    }
+    std::uint64_t scale = max / std::numeric_limits<std::uint32_t>::max() + 1;
+
+    std::vector<std::uint32_t> weights;
+    for (unsigned i = 0; i < site.successors; i++) {
+        weights.push_back(profile[site.firstCounter + i] / scale + 1);
+    }
+    branch->setMetadata(
+        llvm::LLVMContext::MD_prof, llvm::MDBuilder(ctx).createBranchWeights(weights)
+    );
+    weighted.push_back(branch);
+}
+
+bool CodeGen::loadProfile() {
+    std::ifstream in(opts.profileUse, std::ios::binary);
+    if (!in) {
+        std::cerr << "cannot open profile '" << opts.profileUse << "'\n";
+        return false;
+    }
+    std::uint64_t header[2];
+    if (!in.read(reinterpret_cast<char*>(header), sizeof header) ||
+        header[0] != profileMagic) {
+        std::cerr << "'" << opts.profileUse << "' is not an addNMult profile\n";
+        return false;
+    }
+    // Check the counter count against what the file holds before sizing
+    // anything by it; a corrupt header could ask for any amount.
+    auto counters = in.tellg();
+    in.seekg(0, std::ios::end);
+    std::uint64_t remaining = static_cast<std::uint64_t>(in.tellg() - counters);
+    in.seekg(counters);
+    if (header[1] > remaining / sizeof(std::uint64_t)) {
+        std::cerr << "truncated profile '" << opts.profileUse << "'\n";
+        return false;
+    }
+    profile.assign(header[1], 0);
+    if (!in.read(reinterpret_cast<char*>(profile.data()),
+                 profile.size() * sizeof(std::uint64_t))) {
+        std::cerr << "truncated profile '" << opts.profileUse << "'\n";
+        return false;
+    }
+    return true;
+}
+
+bool CodeGen::checkProfile() {
+    if (profile.size() == numCounters) return true;
+
+    // The profile was recorded for a different program. Weights derived from
+    // it would be meaningless, so drop them rather than mislead the optimizer.
+    std::cerr << "warning: profile '" << opts.profileUse << "' has "
+              << profile.size() << " counters but the program has "
+              << numCounters << "; ignoring it\n";
+    for (auto* branch : weighted) {
+        branch->setMetadata(llvm::LLVMContext::MD_prof, nullptr);
+    }
+    weighted.clear();
     return true;
-}
\ No newline at end of file
+}
+
+void CodeGen::emitProfileDump() {
+    auto* i8PtrTy = llvm::Type::getInt8PtrTy(ctx);
+    auto* sizeTy = i64Ty(ctx);
+    auto fopenFn = mod->getOrInsertFunction(
+        "fopen", i8PtrTy, i8PtrTy, i8PtrTy);
+    auto fwriteFn = mod->getOrInsertFunction(
+        "fwrite", sizeTy, i8PtrTy, sizeTy, sizeTy, i8PtrTy);
+    auto fcloseFn = mod->getOrInsertFunction(
+        "fclose", llvm::Type::getInt32Ty(ctx), i8PtrTy);
+
+    auto* dump = Function::Create(
+        llvm::FunctionType::get(llvm::Type::getVoidTy(ctx), false),
+        llvm::Function::InternalLinkage, "__addnmult_prof_dump", mod.get()
+    );
+    auto* entry = BasicBlock::Create(ctx, "entry", dump);
+    auto* write = BasicBlock::Create(ctx, "write", dump);
+    auto* done = BasicBlock::Create(ctx, "done", dump);
+
+    // The counters live in one array per branch site, so write the header
+    // and then each array in site order; that is the order loadProfile and
+    // setBranchWeights index them in.
+    llvm::IRBuilder<> b(entry);
+    Value* file = b.CreateCall(fopenFn, {
+        b.CreateGlobalStringPtr(opts.profileGenerate, "__addnmult_prof_path"),
+        b.CreateGlobalStringPtr("wb", "__addnmult_prof_mode")
+    }, "file");
+    b.CreateCondBr(b.CreateIsNull(file), done, write);
+
+    b.SetInsertPoint(write);
+    auto* headerTy = llvm::ArrayType::get(sizeTy, 2);
+    auto* header = new llvm::GlobalVariable(
+        *mod, headerTy, true, llvm::GlobalValue::InternalLinkage,
+        llvm::ConstantArray::get(headerTy, {
+            ConstantInt::get(sizeTy, profileMagic, false),
+            ConstantInt::get(sizeTy, numCounters, false)
+        }),
+        "__addnmult_prof_header"
+    );
+    auto writeArray = [&](llvm::GlobalVariable* array) {
+        auto* arrayTy = llvm::cast<llvm::ArrayType>(array->getValueType());
+        b.CreateCall(fwriteFn, {
+            b.CreateBitCast(array, i8PtrTy),
+            ConstantInt::get(sizeTy, 8, false),
+            ConstantInt::get(sizeTy, arrayTy->getNumElements(), false),
+            file
+        });
+    };
+    writeArray(header);
+    for (auto* counters : counterArrays) writeArray(counters);
+    b.CreateCall(fcloseFn, {file});
+    b.CreateBr(done);
+
+    b.SetInsertPoint(done);
+    b.CreateRetVoid();
+
+    llvm::appendToGlobalDtors(*mod, dump, 0);
+}
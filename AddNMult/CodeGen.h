@@ -1,7 +1,13 @@
 #pragma once
+#include <cstdint>
+#include <map>
 #include <string>
 #include <memory>
+#include <tuple>
 #include <unordered_map>
+#include <utility>
+#include <vector>
+#include <llvm/IR/DIBuilder.h>
 #include <llvm/IR/IRBuilder.h>
 #include <llvm/IR/LLVMContext.h>
 #include <llvm/IR/Module.h>
@@ -10,25 +16,210 @@
 
 namespace addNMult {
 
+struct CodeGenOptions {
+    // Build SSA form while emitting instead of giving every variable an
+    // alloca: `let`/`set` just rebind the variable's current value and
+    // emitIf inserts phis at the join block.
+    bool ssa = false;
+
+    // Branch profiling. With profileGenerate set, every branch site counts
+    // which successor it takes and the counters are written to that file
+    // when the process exits. With profileUse set, those counts are read
+    // back and attached to the branches as !prof weights.
+    std::string profileGenerate;
+    std::string profileUse;
+
+    // Outline every if arm into a function of its own, called from the
+    // branch, so that a lazy JIT only compiles the arms that run. Arms
+    // copy the variables around them in and out of memory, which the
+    // optimizer only undoes for allocas; this cannot be combined with ssa.
+    bool outlineArms = false;
+
+    // Reuse what the current block has already computed: a variable
+    // loaded again before it is set, or an operation applied again to the
+    // same operand values, gives back the earlier llvm::Value.
+    bool reuseValues = false;
+
+    // Give `let`s of a number a volatile load of that number from a
+    // global instead, so that the optimizer cannot fold the program down
+    // to its result. For benchmarking what the generated code does.
+    bool opaqueLets = false;
+};
+
 class CodeGen {
     public:
-        explicit CodeGen(const std::string& moduleName = "addNMult");
+        explicit CodeGen(const std::string& moduleName = "addNMult",
+                         CodeGenOptions options = {});
+        llvm::LLVMContext& context() { return ctx; }
         llvm::Module* module() const { return mod.get(); }
+        // Hands the module, and the context that owns it, over to the caller
+        // (say, a JIT). The CodeGen cannot be used afterwards.
+        std::pair<std::unique_ptr<llvm::LLVMContext>, std::unique_ptr<llvm::Module>> release();
         llvm::Function* emit(const Program& program);
 
+        // Give everything emitted from the next begin() on a source location,
+        // so optimization remarks and profiles can be traced back to the
+        // program text. Line tables are enough for that; full debug info
+        // also describes addNMult's type and variables for debuggers and
+        // `perf annotate`. setLocation() moves the current location to a
+        // token offset.
+        void setSource(const std::string& fileName, const LineTable& lineTable,
+                       bool fullDebugInfo = false);
+        void setLocation(std::size_t offset);
+
+        // Incremental interface. emit() walks the AST with these, and the
+        // single-pass compiler calls them straight from the parser. begin()
+        // starts addNMult() (failing only if the profile cannot be read),
+        // finish() verifies it and returns it or erases it and returns
+        // nullptr, and discard() abandons it after an error.
+        bool begin();
+        llvm::Function* finish();
+        void discard();
+
+        llvm::Value* number(std::uint64_t value);
+        llvm::Value* boolean(bool value);
+        llvm::Value* variable(const std::string& name);
+        llvm::Value* binary(Op op, llvm::Value* lhs, llvm::Value* rhs);
+
+        bool emitStatement(const Statement* s);
+        bool declareVar(const std::string& name, llvm::Value* init);
+        bool assignVar(const std::string& name, llvm::Value* value);
+        void returnValue(llvm::Value* value);
+        void beginIf(llvm::Value* cond);
+        void beginElse();
+        void endIf();
+
     private:
-        llvm::LLVMContext ctx;
+        std::unique_ptr<llvm::LLVMContext> ownedCtx;
+        llvm::LLVMContext& ctx;
         std::unique_ptr<llvm::Module> mod;
         std::unique_ptr<llvm::IRBuilder<>> builder;
+        CodeGenOptions opts;
+        llvm::Function* function = nullptr;
+
+        std::string sourceName;
+        const LineTable* lines = nullptr;
+        bool fullDebugInfo = false;
+        std::unique_ptr<llvm::DIBuilder> dib;
+        llvm::DICompileUnit* compileUnit = nullptr;
+        llvm::DISubprogram* subprogram = nullptr;
+        llvm::DIBasicType* debugI64 = nullptr;
+        std::unordered_map<std::string, llvm::DILocalVariable*> debugVars;
+        void describeVar(const std::string& name, llvm::Value* value, bool declaration);
+        void describeFunction(unsigned line, llvm::DIType* result);
+        // Alloca per variable, or in SSA mode its current value.
         std::unordered_map<std::string, llvm::Value*> named;
+        llvm::Value* lookup(const std::string& name);
+
+        // With reuseValues, the loads and operations emitted so far in
+        // `reuseBlock`. Operations are keyed on their operand values, so
+        // forgetting a variable's load when it is set also retires every
+        // entry computed from it.
+        llvm::BasicBlock* reuseBlock = nullptr;
+        std::unordered_map<std::string, llvm::Value*> loaded;
+        std::map<std::tuple<Op, llvm::Value*, llvm::Value*>, llvm::Value*> computed;
+        bool reusing();
+
+        // Consecutive profile counters, one per successor of a branch.
+        struct BranchSite {
+            unsigned firstCounter;
+            unsigned successors;
+            llvm::GlobalVariable* counters;
+        };
+        unsigned numCounters = 0;
+        std::vector<llvm::GlobalVariable*> counterArrays;
+        std::vector<std::uint64_t> profile;
+        std::vector<llvm::Instruction*> weighted;
+
+        BranchSite newBranchSite(unsigned successors);
+        void countBranch(const BranchSite& site, llvm::Value* successor);
+        void setBranchWeights(llvm::Instruction* branch, const BranchSite& site);
+        bool loadProfile();
+        bool checkProfile();
+        void emitProfileDump();
+
+        using Definitions = std::unordered_map<std::string, llvm::Value*>;
+        using Incoming = std::vector<std::pair<llvm::BasicBlock*, Definitions>>;
+
+        // An if (or a switch) whose arms are still being emitted. In SSA mode, `saved`
+        // holds the definition at the branch of every outer variable an arm
+        // has reassigned so far, and `declared` the variables the current
+        // arm has introduced. Each arm that falls through records what it
+        // leaves in the saved variables; those flow into phis at ifcont.
+        // Only reassigned variables are tracked, so an if costs time in
+        // proportion to what its arms change, not to everything in scope.
+        struct OpenIf {
+            llvm::Instruction* branch;
+            llvm::BasicBlock* contBlock;
+            bool inElse = false;
+            Definitions saved;
+            std::vector<std::string> declared;
+            Incoming incoming;
+        };
+        std::vector<OpenIf> openIfs;
+        void rebind(const std::string& name, llvm::Value* value);
+        void mergeDefinitions(OpenIf& open);
+        void closeArm(OpenIf& open);
+
+        // Outlined arms get at the variables of the functions around them
+        // through an environment, an array with a slot for every variable
+        // some arm of the function uses. The caller copies the variables
+        // an arm uses into their slots before calling it and back out
+        // afterwards, so only the environment's address escapes and the
+        // variables themselves still become registers. All the calls share
+        // `returnBlock`, for when an arm has returned.
+        struct Environment {
+            llvm::AllocaInst* slots = nullptr;
+            std::unordered_map<std::string, unsigned> index;
+            llvm::BasicBlock* returnBlock = nullptr;
+        };
+        Environment environment;
+
+        // An if arm being emitted into its own function, which takes the
+        // caller's environment and the slot for a returned value, and
+        // returns whether the arm executed a `return`. `captured` lists
+        // the caller's variables it uses; it copies them into variables of
+        // its own on entry. `callBlock` is where the caller will call it;
+        // the rest is the caller's state, restored afterwards.
+        struct OutlinedArm {
+            llvm::Function* function;
+            llvm::BasicBlock* callBlock;
+            std::vector<std::string> captured;
+            Definitions outerNamed;
+            Environment outerEnvironment;
+            llvm::DISubprogram* outerSubprogram;
+            llvm::DebugLoc outerLocation;
+        };
+        std::vector<OutlinedArm> arms;
+        std::vector<llvm::Function*> outlined;
+        llvm::Value* returnSlot = nullptr;
+        void beginArm(llvm::BasicBlock* callBlock, const char* kind);
+        void endArm(llvm::BasicBlock* contBlock);
+        llvm::Value* lookupAt(std::size_t level, const std::string& name);
+        llvm::Value* capture(std::size_t level, const std::string& name);
+        llvm::AllocaInst* entryAlloca(llvm::Type* type, const llvm::Twine& name);
 
         llvm::Value* codegen(const Expression* e);
+        llvm::Value* codegenLeaf(const Expression* e);
         llvm::Value* codegenNumber(const NumberExpression* e);
         llvm::Value* codegenVar(const VarExpression* e);
-        llvm::Value* codegenBinary(const BinaryExpression* e);
         llvm::Value* codegenBool(const BoolExpression* e);
+        llvm::Value* emitBinary(Op op, llvm::Value* lhs, llvm::Value* rhs);
+
+        bool emitIf(const IfStatement& s);
 
-        bool emitStatement(const Statement* s, llvm::Function* function);
-        bool emitIf(const IfStatement& s, llvm::Function* function);
+        // An if/else chain that compares one variable with a different
+        // constant at each step, `if x == 1 {..} else { if x == 2 {..}
+        // else {..} }`, with the if testing each constant and the else
+        // body that runs when none matches.
+        struct CaseChain {
+            const VarExpression* var = nullptr;
+            std::vector<std::pair<std::uint64_t, const IfStatement*>> cases;
+            const std::vector<std::unique_ptr<Statement>>* defaultBody = nullptr;
+        };
+        static CaseChain caseChain(const IfStatement& s);
+        bool emitSwitch(const CaseChain& chain);
+        bool emitArm(llvm::BasicBlock* block, const char* kind,
+                     const std::vector<std::unique_ptr<Statement>>& body);
     };
 }
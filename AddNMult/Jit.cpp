@@ -0,0 +1,171 @@
+#include "Jit.h"
+#include "Optimizer.h"
+#include <iostream>
+#include <unistd.h>
+#include <llvm/ExecutionEngine/Orc/ExecutionUtils.h>
+#include <llvm/ExecutionEngine/Orc/RTDyldObjectLinkingLayer.h>
+#include <llvm/ExecutionEngine/SectionMemoryManager.h>
+#include <llvm/Object/SymbolSize.h>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/TargetSelect.h>
+#include <llvm/Support/raw_ostream.h>
+
+namespace addNMult {
+
+    namespace {
+        // Appends "<address> <size> <name>" for every function the JIT
+        // loads to /tmp/perf-<pid>.map, which perf reads on its own to name
+        // samples in anonymous executable memory. It has no line numbers;
+        // the jitdump listener carries those.
+        class PerfMapListener : public llvm::JITEventListener {
+        public:
+            void notifyObjectLoaded(ObjectKey, const llvm::object::ObjectFile& object,
+                                    const llvm::RuntimeDyld::LoadedObjectInfo& info) override {
+                auto loaded = info.getObjectForDebug(object);
+                const auto* debugObject = loaded.getBinary();
+                if (!debugObject) return;
+
+                std::error_code ec;
+                llvm::raw_fd_ostream map("/tmp/perf-" + std::to_string(::getpid()) + ".map",
+                                         ec, llvm::sys::fs::OF_Append);
+                if (ec) return;
+                for (const auto& [symbol, size] : llvm::object::computeSymbolSizes(*debugObject)) {
+                    auto type = symbol.getType();
+                    if (!type || *type != llvm::object::SymbolRef::ST_Function) continue;
+                    auto name = symbol.getName();
+                    auto address = symbol.getAddress();
+                    if (!name || !address) {
+                        llvm::consumeError(name.takeError());
+                        llvm::consumeError(address.takeError());
+                        continue;
+                    }
+                    map << llvm::format_hex_no_prefix(*address, 1) << ' '
+                        << llvm::format_hex_no_prefix(size, 1) << ' ' << *name << '\n';
+                }
+            }
+        };
+
+        // Sets up an LLJIT, or with LLLazyJITBuilder an LLLazyJIT. Event
+        // listeners hook into RuntimeDyld, so with a perf map listener this
+        // swaps in that linking layer (the default on x86-64 Linux anyway).
+        template <typename Builder>
+        auto build(
+                llvm::orc::JITTargetMachineBuilder host, llvm::JITEventListener* perfMap) {
+            Builder builder;
+            builder.setJITTargetMachineBuilder(std::move(host));
+            if (perfMap) {
+                builder.setObjectLinkingLayerCreator(
+                    [perfMap](llvm::orc::ExecutionSession& session, const llvm::Triple&)
+                        -> llvm::Expected<std::unique_ptr<llvm::orc::ObjectLayer>> {
+                        auto layer = std::make_unique<llvm::orc::RTDyldObjectLinkingLayer>(
+                            session, [] { return std::make_unique<llvm::SectionMemoryManager>(); });
+                        layer->registerJITEventListener(*perfMap);
+                        if (auto* perf = llvm::JITEventListener::createPerfJITEventListener()) {
+                            layer->registerJITEventListener(*perf);
+                        }
+                        if (auto* gdb = llvm::JITEventListener::createGDBRegistrationListener()) {
+                            layer->registerJITEventListener(*gdb);
+                        }
+                        return layer;
+                    });
+            }
+            return builder.create();
+        }
+
+        std::nullptr_t cannotCreate(llvm::Error err) {
+            std::cerr << "cannot create JIT: " << llvm::toString(std::move(err)) << "\n";
+            return nullptr;
+        }
+    }
+
+    llvm::CodeGenOpt::Level codeGenLevel(int optLevel) {
+        switch (optLevel) {
+            case 1:  return llvm::CodeGenOpt::Less;
+            case 2:  return llvm::CodeGenOpt::Default;
+            case 3:  return llvm::CodeGenOpt::Aggressive;
+            default: return llvm::CodeGenOpt::None;
+        }
+    }
+
+    Jit::Jit(std::unique_ptr<llvm::orc::LLJIT> eager,
+             std::unique_ptr<llvm::orc::LLLazyJIT> lazy,
+             std::unique_ptr<llvm::JITEventListener> listener)
+        : perfMap(std::move(listener)), eagerJit(std::move(eager)), lazyJit(std::move(lazy)),
+          jit(lazyJit ? lazyJit.get() : eagerJit.get()) {}
+
+    std::unique_ptr<Jit> Jit::create(llvm::CodeGenOpt::Level level, bool profiling,
+                                     bool lazy) {
+        llvm::InitializeNativeTarget();
+        llvm::InitializeNativeTargetAsmPrinter();
+
+        auto host = llvm::orc::JITTargetMachineBuilder::detectHost();
+        if (!host) return cannotCreate(host.takeError());
+        host->setCodeGenOptLevel(level);
+
+        std::unique_ptr<llvm::JITEventListener> perfMap;
+        if (profiling) perfMap = std::make_unique<PerfMapListener>();
+        std::unique_ptr<Jit> result;
+        if (lazy) {
+            auto jit = build<llvm::orc::LLLazyJITBuilder>(std::move(*host), perfMap.get());
+            if (!jit) return cannotCreate(jit.takeError());
+            result.reset(new Jit(nullptr, std::move(*jit), std::move(perfMap)));
+        } else {
+            auto jit = build<llvm::orc::LLJITBuilder>(std::move(*host), perfMap.get());
+            if (!jit) return cannotCreate(jit.takeError());
+            result.reset(new Jit(std::move(*jit), nullptr, std::move(perfMap)));
+        }
+
+        auto process = llvm::orc::DynamicLibrarySearchGenerator::GetForCurrentProcess(
+            result->jit->getDataLayout().getGlobalPrefix());
+        if (!process) return cannotCreate(process.takeError());
+        result->jit->getMainJITDylib().addGenerator(std::move(*process));
+        return result;
+    }
+
+    void Jit::optimizeOnCompile(unsigned optLevel) {
+        std::shared_ptr<llvm::TargetMachine> machine = createHostTargetMachine();
+        jit->getIRTransformLayer().setTransform(
+            [optLevel, machine](llvm::orc::ThreadSafeModule tsm,
+                                const llvm::orc::MaterializationResponsibility&)
+                -> llvm::Expected<llvm::orc::ThreadSafeModule> {
+                tsm.withModuleDo([&](llvm::Module& module) {
+                    optimize(module, optLevel, machine.get());
+                });
+                return tsm;
+            });
+    }
+
+    // Runs the modules' destructors, which is when an instrumented program
+    // writes its profile.
+    Jit::~Jit() {
+        if (!initialized) return;
+        if (auto err = jit->deinitialize(jit->getMainJITDylib())) {
+            std::cerr << "JIT deinitialization failed: " << llvm::toString(std::move(err)) << "\n";
+        }
+    }
+
+    Jit::EntryPoint Jit::add(std::unique_ptr<llvm::LLVMContext> context,
+                             std::unique_ptr<llvm::Module> module,
+                             const std::string& name) {
+        module->setDataLayout(jit->getDataLayout());
+        llvm::orc::ThreadSafeModule tsm(std::move(module), std::move(context));
+        auto err = lazyJit ? lazyJit->addLazyIRModule(std::move(tsm))
+                           : jit->addIRModule(std::move(tsm));
+        if (err) {
+            std::cerr << "JIT compilation failed: " << llvm::toString(std::move(err)) << "\n";
+            return nullptr;
+        }
+        if (auto err = jit->initialize(jit->getMainJITDylib())) {
+            std::cerr << "JIT initialization failed: " << llvm::toString(std::move(err)) << "\n";
+            return nullptr;
+        }
+        initialized = true;
+
+        auto symbol = jit->lookup(name);
+        if (!symbol) {
+            std::cerr << "JIT lookup failed: " << llvm::toString(symbol.takeError()) << "\n";
+            return nullptr;
+        }
+        return reinterpret_cast<EntryPoint>(symbol->getAddress());
+    }
+}
@@ -0,0 +1,62 @@
+#pragma once
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <llvm/ExecutionEngine/JITEventListener.h>
+#include <llvm/ExecutionEngine/Orc/LLJIT.h>
+#include <llvm/IR/LLVMContext.h>
+#include <llvm/IR/Module.h>
+
+namespace addNMult {
+
+    // Backend effort to go with an IR optimization level: -O<level>, or
+    // no optimization at all for a negative level.
+    llvm::CodeGenOpt::Level codeGenLevel(int optLevel);
+
+    // Compiles modules in-process with ORC's LLJIT so that addNMult() can be
+    // called directly. Symbols the module does not define (the C library's,
+    // for the profile dump) are resolved against the running process.
+    class Jit {
+    public:
+        using EntryPoint = std::int64_t (*)();
+
+        // Prints the reason and returns nullptr if no JIT can be set up.
+        // The level is how hard instruction selection and register
+        // allocation try, independent of the IR pipeline. With `profiling`,
+        // compiled code is announced to perf (a jitdump file for `perf
+        // inject --jit`, and /tmp/perf-<pid>.map for plain `perf report`)
+        // and to gdb, so samples and breakpoints resolve to functions and,
+        // given debug info, to source lines. A `lazy` JIT compiles each
+        // function only when it is first called, so code that never runs
+        // (outlined if arms, say) is never compiled.
+        static std::unique_ptr<Jit> create(
+            llvm::CodeGenOpt::Level level = llvm::CodeGenOpt::Default,
+            bool profiling = false, bool lazy = false);
+        ~Jit();
+
+        // Runs the -O<level> IR pipeline over code as the JIT compiles it
+        // instead of up front; for a lazy JIT that is one function at a
+        // time, when it is first called.
+        void optimizeOnCompile(unsigned optLevel);
+
+        // Compiles the module, runs its constructors, and returns the
+        // address of `name`, or nullptr on failure.
+        EntryPoint add(std::unique_ptr<llvm::LLVMContext> context,
+                       std::unique_ptr<llvm::Module> module,
+                       const std::string& name = "addNMult");
+
+    private:
+        Jit(std::unique_ptr<llvm::orc::LLJIT> eagerJit,
+            std::unique_ptr<llvm::orc::LLLazyJIT> lazyJit,
+            std::unique_ptr<llvm::JITEventListener> perfMap);
+        // Declared first so it outlives the object layer that notifies it.
+        std::unique_ptr<llvm::JITEventListener> perfMap;
+        // Only one of these is set. LLJIT's destructor is not virtual, so
+        // a lazy JIT is owned, and destroyed, as an LLLazyJIT.
+        std::unique_ptr<llvm::orc::LLJIT> eagerJit;
+        std::unique_ptr<llvm::orc::LLLazyJIT> lazyJit;
+        // Whichever of the two is set.
+        llvm::orc::LLJIT* jit;
+        bool initialized = false;
+    };
+}
@@ -1,8 +1,69 @@
 #include "Lexer.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <unistd.h>
 
 namespace addNMult {
 
-    Lexer::Lexer(const std::string& source) : src(source), n(source.size()) {}
+    std::size_t LineTable::lineIndex(std::size_t offset) const {
+        bool onLast = offset >= starts[last] &&
+                      (last + 1 == starts.size() || offset < starts[last + 1]);
+        if (!onLast) {
+            last = std::upper_bound(starts.begin(), starts.end(), offset) - starts.begin() - 1;
+        }
+        return last;
+    }
+
+    void LineTable::forgetBefore(std::size_t offset) {
+        std::size_t index = lineIndex(offset);
+        starts.erase(starts.begin(), starts.begin() + index);
+        forgotten += index;
+        last = 0;
+    }
+
+    unsigned LineTable::line(std::size_t offset) const {
+        return static_cast<unsigned>(forgotten + lineIndex(offset) + 1);
+    }
+
+    unsigned LineTable::column(std::size_t offset) const {
+        return static_cast<unsigned>(offset - starts[lineIndex(offset)] + 1);
+    }
+
+    Lexer::Lexer(const std::string& source) : src(source.data()), n(source.size()) {}
+
+    Lexer::Lexer(int input, std::size_t bufferSize)
+        : src(nullptr), fd(input), buffer(bufferSize < 2 ? 2 : bufferSize) {
+        src = buffer.data();
+    }
+
+    // Drops the consumed part of the buffer and reads more after what is
+    // left. Returns false at the end of the input.
+    bool Lexer::refill() {
+        if (fd < 0) return false;
+        std::memmove(buffer.data(), buffer.data() + i, n - i);
+        base += i;
+        n -= i;
+        i = 0;
+
+        ssize_t r;
+        do {
+            r = ::read(fd, buffer.data() + n, buffer.size() - n);
+        } while (r < 0 && errno == EINTR);
+        if (r < 0) throw std::runtime_error(std::string("read error: ") + std::strerror(errno));
+        if (r == 0) return false;
+        n += static_cast<std::size_t>(r);
+        return true;
+    }
+
+    // Whether src[i + ahead] is available, refilling the buffer if needed.
+    bool Lexer::more(std::size_t ahead) {
+        while (i + ahead >= n) {
+            if (!refill()) return false;
+        }
+        return true;
+    }
 
     bool Lexer::isLetter(char c) {
         unsigned char u = static_cast<unsigned char>(c);
@@ -15,20 +76,21 @@ namespace addNMult {
     }
 
     void Lexer::skipWhitespace() {
-        while (i < n) {
+        while (more()) {
             char c = src[i];
             if (c == ' ' || c == '\t' || c == '\n' || c == '\r') {
                 i++;
+                if (c == '\n' && tracking) lineTable.addLine(base + i);
             } else {
                 break;
             }
         }
     }
 
-    Token Lexer::tokenize(TokenKind k, std::size_t start, std::size_t len) const {
+    Token Lexer::tokenize(TokenKind k, std::size_t start, std::string text) const {
         Token t;
         t.kind = k;
-        t.stringToken = src.substr(start, len);
+        t.stringToken = std::move(text);
         t.offset = start;
         if (k == TokenKind::Number) {
             std::uint64_t v = 0;
@@ -41,22 +103,30 @@ namespace addNMult {
     }
 
     Token Lexer::tokenizeOperator(TokenKind k, std::size_t len) {
-        std::size_t start = i;
+        std::size_t start = base + i;
+        std::string text(src + i, len);
         i += len;
-        return tokenize(k, start, len);
+        return tokenize(k, start, std::move(text));
     }
 
     Token Lexer::lexIdentifierOrKeyword() {
-        std::size_t start = i++;
-        while (i < n && (isLetter(src[i]) || isDigit(src[i]))) i++;
-        std::string s = src.substr(start, i - start);
-        if (s == "let") return tokenize(TokenKind::Let, start, s.size());
-        if (s == "return") return tokenize(TokenKind::Return, start, s.size());
-        if (s == "set")    return tokenize(TokenKind::Set, start, s.size());
-        if (s == "if")     return tokenize(TokenKind::If, start, s.size());
-        if (s == "else")   return tokenize(TokenKind::Else, start, s.size());
-        if (s == "true")   return tokenize(TokenKind::True, start, s.size());
-        if (s == "false")  return tokenize(TokenKind::False, start, s.size());
+        std::size_t start = base + i;
+        std::string s;
+        // Identifiers may straddle a refill, so collect them a window at a time.
+        std::size_t from = i++;
+        while (true) {
+            while (i < n && (isLetter(src[i]) || isDigit(src[i]))) i++;
+            s.append(src + from, i - from);
+            if (i < n || !refill()) break;
+            from = i;
+        }
+        if (s == "let") return tokenize(TokenKind::Let, start, s);
+        if (s == "return") return tokenize(TokenKind::Return, start, s);
+        if (s == "set")    return tokenize(TokenKind::Set, start, s);
+        if (s == "if")     return tokenize(TokenKind::If, start, s);
+        if (s == "else")   return tokenize(TokenKind::Else, start, s);
+        if (s == "true")   return tokenize(TokenKind::True, start, s);
+        if (s == "false")  return tokenize(TokenKind::False, start, s);
         Token t;
         t.kind = TokenKind::Varname;
         t.stringToken = s;
@@ -65,14 +135,21 @@ namespace addNMult {
     }
 
     Token Lexer::lexNumber() {
-        std::size_t start = i;
-        while (i < n && isDigit(src[i])) i++;
-        return tokenize(TokenKind::Number, start, i - start);
+        std::size_t start = base + i;
+        std::string s;
+        std::size_t from = i;
+        while (true) {
+            while (i < n && isDigit(src[i])) i++;
+            s.append(src + from, i - from);
+            if (i < n || !refill()) break;
+            from = i;
+        }
+        return tokenize(TokenKind::Number, start, std::move(s));
     }
 
     Token Lexer::next() {
         skipWhitespace();
-        if (i >= n) return tokenize(TokenKind::Eof, i, 0);
+        if (!more()) return tokenize(TokenKind::Eof, base + i, "");
 
         unsigned char c = static_cast<unsigned char>(src[i]);
         if (isLetter(c)) return lexIdentifierOrKeyword();
@@ -86,34 +163,26 @@ namespace addNMult {
             case '{': return tokenizeOperator(TokenKind::OpenBrace, 1);
             case '}': return tokenizeOperator(TokenKind::CloseBrace, 1);
             case '=': {
-                if (i + 1 < n && src[i+1] == '=') {
-                    Token t = tokenize(TokenKind::IsEqual, i, 2);
-                    i += 2;
-                    return t;
+                if (more(1) && src[i+1] == '=') {
+                    return tokenizeOperator(TokenKind::IsEqual, 2);
                 }
                 return tokenizeOperator(TokenKind::Eq, 1);
             } 
             case '!': {
-                if (i + 1 < n && src[i+1] == '=') {
-                    Token t = tokenize(TokenKind::IsNotEqual, i, 2);
-                    i += 2;
-                    return t;
+                if (more(1) && src[i+1] == '=') {
+                    return tokenizeOperator(TokenKind::IsNotEqual, 2);
                 }
                 return tokenizeOperator(TokenKind::Invalid, 1);
             } 
             case '<': {
-                if (i + 1 < n && src[i+1] == '=') {
-                    Token t = tokenize(TokenKind::LessEqual, i, 2);
-                    i += 2;
-                    return t;
+                if (more(1) && src[i+1] == '=') {
+                    return tokenizeOperator(TokenKind::LessEqual, 2);
                 }
                 return tokenizeOperator(TokenKind::Less, 1);
             } 
             case '>': {
-                if (i + 1 < n && src[i+1] == '=') {
-                    Token t = tokenize(TokenKind::GreaterEqual, i, 2);
-                    i += 2;
-                    return t;
+                if (more(1) && src[i+1] == '=') {
+                    return tokenizeOperator(TokenKind::GreaterEqual, 2);
                 }
                 return tokenizeOperator(TokenKind::Greater, 1);
             }
@@ -1,6 +1,7 @@
 #pragma once
 #include <cstdint>
 #include <string>
+#include <vector>
 
 namespace addNMult {
 
@@ -18,21 +19,63 @@ namespace addNMult {
         std::size_t offset = 0;
     };
 
+    // Maps source offsets to 1-based lines and columns. The lexer records
+    // where each line starts as it skips newlines; lookups are a binary
+    // search, short-circuited when the offset is on the same line as the
+    // previous one, which is the common case when walking a program in order.
+    // forgetBefore() drops the lines before an offset that will not be
+    // asked about again, keeping the numbering of the rest.
+    class LineTable {
+        public:
+            void addLine(std::size_t start) { starts.push_back(start); }
+            void forgetBefore(std::size_t offset);
+            unsigned line(std::size_t offset) const;
+            unsigned column(std::size_t offset) const;
+        private:
+            std::vector<std::size_t> starts{0};
+            std::size_t forgotten = 0;
+            mutable std::size_t last = 0;
+
+            std::size_t lineIndex(std::size_t offset) const;
+    };
+
     class Lexer {
         public:
             Lexer(const std::string& source);
+            // Reads the source from fd through a fixed-size buffer that is
+            // refilled as tokens are consumed, so input of any length can be
+            // lexed in constant memory.
+            explicit Lexer(int fd, std::size_t bufferSize = 64 * 1024);
             Token next();
+
+            // Lines are only recorded after trackLines(), by callers that
+            // will map offsets to locations; otherwise the table would grow
+            // with the input for nothing. Streaming callers forget the
+            // lines of each statement once it has been compiled.
+            void trackLines() { tracking = true; }
+            void forgetLinesBefore(std::size_t offset) { lineTable.forgetBefore(offset); }
+            const LineTable& lines() const { return lineTable; }
         private:
-            const std::string& src;
+            // src[0, n) is the part of the source currently in memory: all
+            // of it for a string, the buffered part for a file descriptor.
+            // base is the source offset of src[0].
+            const char* src;
             std::size_t n = 0;
             std::size_t i = 0;
+            std::size_t base = 0;
+            int fd = -1;
+            std::vector<char> buffer;
+            LineTable lineTable;
+            bool tracking = false;
 
+            bool refill();
+            bool more(std::size_t ahead = 0);
             static bool isLetter(char c);
             static bool isDigit(char c);
             void skipWhitespace();
-            Token tokenize(TokenKind k, std::size_t start, std::size_t len) const;
+            Token tokenize(TokenKind k, std::size_t start, std::string text) const;
             Token tokenizeOperator(TokenKind k, std::size_t len);
             Token lexIdentifierOrKeyword();
             Token lexNumber();
     };
-}
\ No newline at end of file
+}
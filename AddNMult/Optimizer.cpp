@@ -0,0 +1,49 @@
+#include "Optimizer.h"
+#include <iostream>
+#include <llvm/MC/TargetRegistry.h>
+#include <llvm/Passes/PassBuilder.h>
+#include <llvm/Support/Host.h>
+#include <llvm/Support/TargetSelect.h>
+
+namespace addNMult {
+
+    std::unique_ptr<llvm::TargetMachine> createHostTargetMachine() {
+        llvm::InitializeNativeTarget();
+        std::string triple = llvm::sys::getDefaultTargetTriple();
+        std::string error;
+        const llvm::Target* target = llvm::TargetRegistry::lookupTarget(triple, error);
+        if (!target) {
+            std::cerr << error << "\n";
+            return nullptr;
+        }
+        return std::unique_ptr<llvm::TargetMachine>(target->createTargetMachine(
+            triple, "generic", "", llvm::TargetOptions(), llvm::None));
+    }
+
+    void optimize(llvm::Module& module, unsigned level, llvm::TargetMachine* machine) {
+        llvm::LoopAnalysisManager loops;
+        llvm::FunctionAnalysisManager functions;
+        llvm::CGSCCAnalysisManager sccs;
+        llvm::ModuleAnalysisManager modules;
+
+        llvm::PassBuilder passes(machine);
+        passes.registerModuleAnalyses(modules);
+        passes.registerCGSCCAnalyses(sccs);
+        passes.registerFunctionAnalyses(functions);
+        passes.registerLoopAnalyses(loops);
+        passes.crossRegisterProxies(loops, functions, sccs, modules);
+
+        llvm::OptimizationLevel optLevel;
+        switch (level) {
+            case 0:  optLevel = llvm::OptimizationLevel::O0; break;
+            case 1:  optLevel = llvm::OptimizationLevel::O1; break;
+            case 2:  optLevel = llvm::OptimizationLevel::O2; break;
+            default: optLevel = llvm::OptimizationLevel::O3; break;
+        }
+
+        llvm::ModulePassManager pipeline = level == 0
+            ? passes.buildO0DefaultPipeline(optLevel)
+            : passes.buildPerModuleDefaultPipeline(optLevel);
+        pipeline.run(module, modules);
+    }
+}
@@ -0,0 +1,17 @@
+#pragma once
+#include <memory>
+#include <llvm/IR/Module.h>
+#include <llvm/Target/TargetMachine.h>
+
+namespace addNMult {
+
+    // A target machine for the host, or nullptr (after printing why) if
+    // LLVM was built without support for it.
+    std::unique_ptr<llvm::TargetMachine> createHostTargetMachine();
+
+    // Runs LLVM's default -O<level> pipeline (0 to 3) over the module.
+    // With a target machine the passes see the host's cost model; without
+    // one they fall back to LLVM's generic assumptions.
+    void optimize(llvm::Module& module, unsigned level,
+                  llvm::TargetMachine* machine = nullptr);
+}
@@ -1,8 +1,86 @@
 #include "Parser.h"
+#include <algorithm>
+#include <iterator>
 
 namespace addNMult {
 
-    Parser::Parser(Lexer& lexer) : lex(lexer) { next(); }
+    // Releasing `lhs` the ordinary way would run its destructor, which
+    // releases its own `lhs`, and so on down a left-deep chain, a native
+    // frame per operation. Instead, operands this node holds the last
+    // reference to are taken apart here, their operands moved onto the
+    // worklist before they are freed, so each destructor in the chain
+    // finds nothing left to release. The nodes were created non-const, so
+    // taking their operands through const_cast is sound.
+    BinaryExpression::~BinaryExpression() {
+        std::vector<std::shared_ptr<const Expression>> worklist;
+        worklist.push_back(std::move(lhs));
+        worklist.push_back(std::move(rhs));
+        while (!worklist.empty()) {
+            std::shared_ptr<const Expression> operand = std::move(worklist.back());
+            worklist.pop_back();
+            if (!operand || operand.use_count() != 1) continue;
+            auto* binary = dynamic_cast<const BinaryExpression*>(operand.get());
+            if (!binary) continue;
+            auto* owned = const_cast<BinaryExpression*>(binary);
+            worklist.push_back(std::move(owned->lhs));
+            worklist.push_back(std::move(owned->rhs));
+        }
+    }
+
+    Parser::Parser(Lexer& lexer)
+        : lex(lexer),
+          trueExpression(std::make_shared<BoolExpression>(true)),
+          falseExpression(std::make_shared<BoolExpression>(false)) { next(); }
+
+    template <typename Table, typename Key, typename Make>
+    static std::shared_ptr<const Expression> intern(Table& table, const Key& key, Make make) {
+        std::weak_ptr<const Expression>& entry = table[key];
+        if (auto existing = entry.lock()) return existing;
+        std::shared_ptr<const Expression> created = make();
+        entry = created;
+        return created;
+    }
+
+    std::shared_ptr<const Expression> Parser::number(std::uint64_t value) {
+        sweep();
+        return intern(numbers, value, [&] {
+            return std::make_shared<NumberExpression>(value);
+        });
+    }
+
+    std::shared_ptr<const Expression> Parser::variable(const std::string& name) {
+        sweep();
+        return intern(variables, name, [&] {
+            return std::make_shared<VarExpression>(name);
+        });
+    }
+
+    // A key whose operands have died cannot match a live expression: the
+    // node it names would have kept them alive. So if the addresses have
+    // been reused, lock() fails and the entry is simply replaced.
+    std::shared_ptr<const Expression> Parser::binary(Op op, std::shared_ptr<const Expression> lhs,
+                                                     std::shared_ptr<const Expression> rhs) {
+        sweep();
+        return intern(binaries, std::make_tuple(op, lhs.get(), rhs.get()), [&] {
+            return std::make_shared<BinaryExpression>(op, std::move(lhs), std::move(rhs));
+        });
+    }
+
+    // Drops the entries of expressions that no longer exist once the
+    // tables have doubled since the last sweep.
+    void Parser::sweep() {
+        if (numbers.size() + variables.size() + binaries.size() < sweepAt) return;
+        auto dropExpired = [](auto& table) {
+            for (auto it = table.begin(); it != table.end();) {
+                it = it->second.expired() ? table.erase(it) : std::next(it);
+            }
+        };
+        dropExpired(numbers);
+        dropExpired(variables);
+        dropExpired(binaries);
+        sweepAt = std::max<std::size_t>(
+            1024, 2 * (numbers.size() + variables.size() + binaries.size()));
+    }
 
     void Parser::next() { token = lex.next(); }
 
@@ -16,13 +94,18 @@ namespace addNMult {
     std::unique_ptr<Program> Parser::parseProgram() {
         auto program = std::make_unique<Program>();
 
-        while (!is(TokenKind::Eof)) {
-            program->statements.push_back(parseStatement());
+        while (auto statement = parseTopLevel()) {
+            program->statements.push_back(std::move(statement));
         }
 
         return program;
     }
 
+    std::unique_ptr<Statement> Parser::parseTopLevel() {
+        if (is(TokenKind::Eof)) return nullptr;
+        return parseStatement();
+    }
+
     std::unique_ptr<VarDecl> Parser::parseLet() {
         expect(TokenKind::Let, "'let'");
         if (!is(TokenKind::Varname)) throw std::runtime_error("expected identifier");
@@ -78,7 +161,7 @@ namespace addNMult {
         return s;
     }
 
-    std::unique_ptr<Expression> Parser::parseCompare() {
+    std::shared_ptr<const Expression> Parser::parseCompare() {
         auto left = parseSumNums();
         if (is(TokenKind::IsEqual)      || is(TokenKind::IsNotEqual)   ||
             is(TokenKind::Less)         || is(TokenKind::LessEqual)    ||
@@ -98,31 +181,29 @@ namespace addNMult {
                     throw std::runtime_error("invalid compare operator");
             }
 
-            return std::unique_ptr<Expression>(
-                new BinaryExpression(op, left.release(), right.release())
-            );
+            return binary(op, std::move(left), std::move(right));
         }
         return left;
     }
 
-    std::unique_ptr<Expression> Parser::parseRHS() { return parseSumNums(); }
+    std::shared_ptr<const Expression> Parser::parseRHS() { return parseSumNums(); }
 
-    std::unique_ptr<Expression> Parser::parseSumNums() {
+    std::shared_ptr<const Expression> Parser::parseSumNums() {
         auto e = parseProdNums();
         while (is(TokenKind::Plus)) {
             next();
             auto r = parseProdNums();
-            e = std::unique_ptr<Expression>(new BinaryExpression(Op::Add, e.release(), r.release()));
+            e = binary(Op::Add, std::move(e), std::move(r));
         }
         return e;
     }
 
-    std::unique_ptr<Expression> Parser::parseProdNums() {
+    std::shared_ptr<const Expression> Parser::parseProdNums() {
         auto e = parseEval();
         while (is(TokenKind::Star)) {
             next();
             auto r = parseEval();
-            e = std::unique_ptr<Expression>(new BinaryExpression(Op::Mul, e.release(), r.release()));
+            e = binary(Op::Mul, std::move(e), std::move(r));
         }
         return e;
     }
@@ -136,46 +217,49 @@ namespace addNMult {
     }
 
     std::unique_ptr<Statement> Parser::parseStatement() {
+        std::size_t offset = token.offset;
+        std::unique_ptr<Statement> statement;
         if (is(TokenKind::Let)) {
             auto decl = parseLet();
-            return std::unique_ptr<Statement>(decl.release());
-        }
-        if (is(TokenKind::Set)) {
+            statement.reset(decl.release());
+        } else if (is(TokenKind::Set)) {
             SetStatement s = parseSet();
-            return std::unique_ptr<Statement>(new SetStatement(std::move(s)));
-        }
-        if (is(TokenKind::If)) {
+            statement.reset(new SetStatement(std::move(s)));
+        } else if (is(TokenKind::If)) {
             auto ifStmt = parseIf();
-            return std::unique_ptr<Statement>(ifStmt.release());
-        }
-        if (is(TokenKind::Return)) {
+            statement.reset(ifStmt.release());
+        } else if (is(TokenKind::Return)) {
             auto retStmt = parseReturn();
-            return std::unique_ptr<Statement>(retStmt.release());
+            statement.reset(retStmt.release());
         }
 
+        if (statement) {
+            statement->offset = offset;
+            return statement;
+        }
         throw std::runtime_error("expected statement");
     }
 
 
-    std::unique_ptr<Expression> Parser::parseEval() {
+    std::shared_ptr<const Expression> Parser::parseEval() {
         switch (token.kind) {
             case TokenKind::Number: {
                 auto tokenVal = token.numberValue;
                 next();
-                return std::unique_ptr<Expression>(new NumberExpression(tokenVal));
+                return number(tokenVal);
             }
             case TokenKind::Varname: {
                 std::string tokenVal = token.stringToken;
                 next();
-                return std::unique_ptr<Expression>(new VarExpression(tokenVal));
+                return variable(tokenVal);
             }
             case TokenKind::True: {
                 next();
-                return std::unique_ptr<Expression>(new BoolExpression(true));
+                return trueExpression;
             }
             case TokenKind::False: {
                 next();
-                return std::unique_ptr<Expression>(new BoolExpression(false));
+                return falseExpression;
             }
             case TokenKind::OpenParen: {
                 next();
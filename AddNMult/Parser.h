@@ -1,13 +1,18 @@
 #pragma once
+#include <map>
 #include <memory>
 #include <string>
 #include <stdexcept>
+#include <tuple>
+#include <unordered_map>
 #include <vector>
 #include <cstdint>
 #include "Lexer.h"
 
 namespace addNMult {
 
+    // Expressions are immutable and shared: the parser hands out the same
+    // node for every occurrence of an expression.
     struct Expression {
         virtual ~Expression() = default;
     };
@@ -35,32 +40,38 @@ namespace addNMult {
         // if we have 2 + 3
         Op op; // this will hold +
         // and lhs will hold 2 and rhs will hold 3.
-        std::unique_ptr<Expression> lhs;
-        std::unique_ptr<Expression> rhs;
-        BinaryExpression(Op o, Expression* a, Expression* b) : op(o), lhs(a), rhs(b) {}
+        std::shared_ptr<const Expression> lhs;
+        std::shared_ptr<const Expression> rhs;
+        BinaryExpression(Op o, std::shared_ptr<const Expression> a,
+                         std::shared_ptr<const Expression> b)
+            : op(o), lhs(std::move(a)), rhs(std::move(b)) {}
+        // Frees the operands without recursing, however deep they go.
+        ~BinaryExpression() override;
     };
 
     struct Statement {
         virtual ~Statement() = default;
+        // Source offset of the statement's first token.
+        std::size_t offset = 0;
     };
 
     struct VarDecl : Statement {
         std::string name;
-        std::unique_ptr<Expression> value;
+        std::shared_ptr<const Expression> value;
     };
 
     struct SetStatement : Statement {
         std::string name;
-        std::unique_ptr<Expression> value;
+        std::shared_ptr<const Expression> value;
     };
 
     struct ReturnStatement : Statement {
-        std::unique_ptr<Expression> value;
+        std::shared_ptr<const Expression> value;
     };
 
 
     struct IfStatement : Statement {
-        std::unique_ptr<Expression> cond;
+        std::shared_ptr<const Expression> cond;
         std::vector<std::unique_ptr<Statement>> thenBody;
         std::vector<std::unique_ptr<Statement>> elseBody;
     };
@@ -73,6 +84,8 @@ namespace addNMult {
     public:
         explicit Parser(Lexer& lx);
         std::unique_ptr<Program> parseProgram();
+        // The next top-level statement, or nullptr at the end of the input.
+        std::unique_ptr<Statement> parseTopLevel();
         std::unique_ptr<VarDecl> parseLet();
 
     private:
@@ -83,11 +96,31 @@ namespace addNMult {
         bool is(TokenKind k) const;
         void expect(TokenKind k, const char* what);
 
-        std::unique_ptr<Expression> parseRHS();
-        std::unique_ptr<Expression> parseSumNums();
-        std::unique_ptr<Expression> parseProdNums();
-        std::unique_ptr<Expression> parseEval();
-        std::unique_ptr<Expression> parseCompare();
+        std::shared_ptr<const Expression> parseRHS();
+        std::shared_ptr<const Expression> parseSumNums();
+        std::shared_ptr<const Expression> parseProdNums();
+        std::shared_ptr<const Expression> parseEval();
+        std::shared_ptr<const Expression> parseCompare();
+
+        // Hash-consing: a node is looked up by its value, name, or operator
+        // and operand identities before a new one is made, so a repeated
+        // subexpression is allocated once however often it occurs. The
+        // tables only hold weak references, and dead entries are swept out
+        // as the tables grow, so streaming, which frees each statement once
+        // it is compiled, still runs in bounded memory.
+        std::unordered_map<std::uint64_t, std::weak_ptr<const Expression>> numbers;
+        std::unordered_map<std::string, std::weak_ptr<const Expression>> variables;
+        std::map<std::tuple<Op, const Expression*, const Expression*>,
+                 std::weak_ptr<const Expression>> binaries;
+        std::shared_ptr<const Expression> trueExpression;
+        std::shared_ptr<const Expression> falseExpression;
+        std::size_t sweepAt = 1024;
+
+        std::shared_ptr<const Expression> number(std::uint64_t value);
+        std::shared_ptr<const Expression> variable(const std::string& name);
+        std::shared_ptr<const Expression> binary(Op op, std::shared_ptr<const Expression> lhs,
+                                                 std::shared_ptr<const Expression> rhs);
+        void sweep();
 
         std::unique_ptr<Statement> parseStatement();
         std::unique_ptr<ReturnStatement> parseReturn();
@@ -78,9 +78,13 @@ namespace addNMult {
         return false;
     }
 
-    bool SemanticAnalyzer::analyze(const Program& program) {
+    void SemanticAnalyzer::begin() {
         scopes.clear();
         pushScope();
+    }
+
+    bool SemanticAnalyzer::analyze(const Program& program) {
+        begin();
 
         for (const std::unique_ptr<Statement>& statementPtr : program.statements) 
         {
@@ -169,36 +173,46 @@ namespace addNMult {
         return false;
     }
 
+    // Walks the expression with a worklist rather than recursion, since
+    // a generated `a + a + ... + a` can be a million operations deep.
+    // Operands are pushed right first so variables are checked left to
+    // right, as written.
     bool SemanticAnalyzer::analyzeExpression(const Expression* expression) {
-        if (expression == nullptr) {
-            return true;
-        }
+        std::vector<const Expression*> worklist{expression};
+        while (!worklist.empty()) {
+            expression = worklist.back();
+            worklist.pop_back();
 
-        if (dynamic_cast<const NumberExpression*>(expression)) {
-            return true;
-        }
+            if (expression == nullptr) {
+                continue;
+            }
 
-        if (dynamic_cast<const BoolExpression*>(expression)) {
-            return true;
-        }
+            if (dynamic_cast<const NumberExpression*>(expression)) {
+                continue;
+            }
 
-        if (auto variableExpression = 
-            dynamic_cast<const VarExpression*>(expression)) {
-            return checkVarUse(variableExpression->name);
-        }
+            if (dynamic_cast<const BoolExpression*>(expression)) {
+                continue;
+            }
 
-        if (auto binaryExpression = 
-            dynamic_cast<const BinaryExpression*>(expression)) {
-            if (!analyzeExpression(binaryExpression->lhs.get())) {
-                return false;
+            if (auto variableExpression = 
+                dynamic_cast<const VarExpression*>(expression)) {
+                if (!checkVarUse(variableExpression->name)) {
+                    return false;
+                }
+                continue;
             }
-            if (!analyzeExpression(binaryExpression->rhs.get())) {
-                return false;
+
+            if (auto binaryExpression = 
+                dynamic_cast<const BinaryExpression*>(expression)) {
+                worklist.push_back(binaryExpression->rhs.get());
+                worklist.push_back(binaryExpression->lhs.get());
+                continue;
             }
-            return true;
-        }
 
-        std::cerr << "unknown expression kind\n";
-        return false;
+            std::cerr << "unknown expression kind\n";
+            return false;
+        }
+        return true;
     }
 }
\ No newline at end of file
@@ -15,10 +15,10 @@ namespace addNMult {
     class SemanticAnalyzer {
         public:
             bool analyze(const Program& program);
-        
-        private:
-            std::vector<std::unordered_map<std::string, VarState>> scopes;
-        
+
+            // Scope tracking on its own, for the single-pass compiler, which
+            // checks names as it parses instead of walking a Program.
+            void begin();
             void pushScope();
             void popScope();
         
@@ -26,8 +26,14 @@ namespace addNMult {
             bool isDeclared(const std::string& name) const;
             bool setInitialized(const std::string& name);
             bool checkVarUse(const std::string& name);
-        
+
+            // Checks one statement against the scopes set up by begin(),
+            // for callers that do not hold the whole Program at once.
             bool analyzeStatement(const Statement* statement);
+
+        private:
+            std::vector<std::unordered_map<std::string, VarState>> scopes;
+        
             bool analyzeExpression(const Expression* expression);
     };
 }
\ No newline at end of file
@@ -0,0 +1,173 @@
+#include "SinglePassCompiler.h"
+#include <stdexcept>
+
+namespace addNMult {
+
+    SinglePassCompiler::SinglePassCompiler(Lexer& lx, CodeGen& cg)
+        : lex(lx), codegen(cg) { next(); }
+
+    void SinglePassCompiler::next() { token = lex.next(); }
+
+    bool SinglePassCompiler::is(TokenKind k) const { return token.kind == k; }
+
+    void SinglePassCompiler::expect(TokenKind k, const char* what) {
+        if (!is(k)) throw std::runtime_error(std::string("expected ") + what);
+        next();
+    }
+
+    std::string SinglePassCompiler::expectName() {
+        if (!is(TokenKind::Varname)) throw std::runtime_error("expected identifier");
+        std::string name = token.stringToken;
+        next();
+        return name;
+    }
+
+    // The analyzer has already said what is wrong; all that is left to do
+    // is to stop compiling.
+    void SinglePassCompiler::check(bool ok) {
+        if (!ok) throw std::runtime_error("semantic analysis failed");
+    }
+
+    llvm::Function* SinglePassCompiler::compile() {
+        if (!codegen.begin()) return nullptr;
+        analyzer.begin();
+        try {
+            while (!is(TokenKind::Eof)) {
+                lex.forgetLinesBefore(token.offset);
+                compileStatement();
+            }
+        } catch (...) {
+            codegen.discard();
+            throw;
+        }
+        return codegen.finish();
+    }
+
+    void SinglePassCompiler::compileStatement() {
+        codegen.setLocation(token.offset);
+        if (is(TokenKind::Let))    return compileLet();
+        if (is(TokenKind::Set))    return compileSet();
+        if (is(TokenKind::If))     return compileIf();
+        if (is(TokenKind::Return)) return compileReturn();
+        throw std::runtime_error("expected statement");
+    }
+
+    void SinglePassCompiler::compileLet() {
+        expect(TokenKind::Let, "'let'");
+        std::string name = expectName();
+        expect(TokenKind::Eq, "'='");
+        check(analyzer.declare(name));
+        llvm::Value* value = compileCompare();
+        check(analyzer.setInitialized(name));
+        check(codegen.declareVar(name, value));
+    }
+
+    void SinglePassCompiler::compileSet() {
+        expect(TokenKind::Set, "'set'");
+        std::string name = expectName();
+        expect(TokenKind::Eq, "'='");
+        check(analyzer.isDeclared(name));
+        llvm::Value* value = compileCompare();
+        check(analyzer.setInitialized(name));
+        check(codegen.assignVar(name, value));
+    }
+
+    void SinglePassCompiler::compileIf() {
+        expect(TokenKind::If, "'if'");
+        codegen.beginIf(compileCompare());
+        compileBlock();
+
+        if (is(TokenKind::Else)) {
+            next();
+            codegen.beginElse();
+            compileBlock();
+        }
+        codegen.endIf();
+    }
+
+    void SinglePassCompiler::compileBlock() {
+        expect(TokenKind::OpenBrace, "'{'");
+        analyzer.pushScope();
+        while (is(TokenKind::Let) || is(TokenKind::Set) ||
+               is(TokenKind::If) || is(TokenKind::Return)) {
+            compileStatement();
+        }
+        analyzer.popScope();
+        expect(TokenKind::CloseBrace, "'}'");
+    }
+
+    void SinglePassCompiler::compileReturn() {
+        expect(TokenKind::Return, "'return'");
+        codegen.returnValue(compileCompare());
+    }
+
+    llvm::Value* SinglePassCompiler::compileCompare() {
+        llvm::Value* left = compileSumNums();
+        Op op;
+        switch (token.kind) {
+            case TokenKind::IsEqual:        op = Op::Equal;                break;
+            case TokenKind::IsNotEqual:     op = Op::NotEqual;             break;
+            case TokenKind::Less:           op = Op::LessThan;             break;
+            case TokenKind::LessEqual:      op = Op::LessThanOrEqual;      break;
+            case TokenKind::Greater:        op = Op::GreaterThan;          break;
+            case TokenKind::GreaterEqual:   op = Op::GreaterThanOrEqual;   break;
+            default:
+                return left;
+        }
+        next();
+        llvm::Value* right = compileSumNums();
+        return codegen.binary(op, left, right);
+    }
+
+    llvm::Value* SinglePassCompiler::compileSumNums() {
+        llvm::Value* e = compileProdNums();
+        while (is(TokenKind::Plus)) {
+            next();
+            llvm::Value* r = compileProdNums();
+            e = codegen.binary(Op::Add, e, r);
+        }
+        return e;
+    }
+
+    llvm::Value* SinglePassCompiler::compileProdNums() {
+        llvm::Value* e = compileEval();
+        while (is(TokenKind::Star)) {
+            next();
+            llvm::Value* r = compileEval();
+            e = codegen.binary(Op::Mul, e, r);
+        }
+        return e;
+    }
+
+    llvm::Value* SinglePassCompiler::compileEval() {
+        switch (token.kind) {
+            case TokenKind::Number: {
+                auto tokenVal = token.numberValue;
+                next();
+                return codegen.number(tokenVal);
+            }
+            case TokenKind::Varname: {
+                std::string tokenVal = token.stringToken;
+                next();
+                check(analyzer.checkVarUse(tokenVal));
+                return codegen.variable(tokenVal);
+            }
+            case TokenKind::True: {
+                next();
+                return codegen.boolean(true);
+            }
+            case TokenKind::False: {
+                next();
+                return codegen.boolean(false);
+            }
+            case TokenKind::OpenParen: {
+                next();
+                llvm::Value* inner = compileCompare();
+                expect(TokenKind::CloseParen, "')'");
+                return inner;
+            }
+            default:
+                throw std::runtime_error("expected a number, variable, or parenthensis.");
+        }
+    }
+}
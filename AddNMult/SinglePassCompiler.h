@@ -0,0 +1,43 @@
+#pragma once
+#include <string>
+#include <llvm/IR/Function.h>
+#include "CodeGen.h"
+#include "Lexer.h"
+#include "SemanticAnalyzer.h"
+
+namespace addNMult {
+
+    // Syntax-directed compilation: the same grammar as Parser, but each
+    // construct is scope-checked and handed to CodeGen the moment it is
+    // recognised, so no AST is ever built. Memory use is bounded by the
+    // nesting depth of the program instead of its size.
+    class SinglePassCompiler {
+    public:
+        SinglePassCompiler(Lexer& lx, CodeGen& cg);
+        llvm::Function* compile();
+
+    private:
+        Lexer& lex;
+        CodeGen& codegen;
+        SemanticAnalyzer analyzer;
+        Token token;
+
+        void next();
+        bool is(TokenKind k) const;
+        void expect(TokenKind k, const char* what);
+        std::string expectName();
+        void check(bool ok);
+
+        void compileStatement();
+        void compileLet();
+        void compileSet();
+        void compileIf();
+        void compileReturn();
+        void compileBlock();
+
+        llvm::Value* compileCompare();
+        llvm::Value* compileSumNums();
+        llvm::Value* compileProdNums();
+        llvm::Value* compileEval();
+    };
+}
@@ -0,0 +1,213 @@
+// Measures how fast the code addnmult generates runs. Every program in the
+// corpus is compiled through each code generation path (allocas, allocas
+// reusing values within a block, or direct SSA construction) at each
+// optimization level (none, -O0 to -O3), JIT-ed, and its addNMult() called
+// in a loop. Each configuration reports the compile time and the mean and
+// standard deviation of ns/call over several rounds, and every path is
+// checked to compute the same result.
+//
+// The programs have no inputs, so left alone the optimizer would reduce
+// each one to `ret <result>`. Numbers bound by `let` are loaded through
+// volatile globals instead (CodeGenOptions::opaqueLets), which leaves the
+// computation for the generated code to do on every call.
+//
+//   addnmult-bench [--iterations=N] [--rounds=N] [program.anm...]
+//
+// Without programs, the corpus in bench/corpus is used.
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include "CodeGen.h"
+#include "Jit.h"
+#include "Lexer.h"
+#include "Optimizer.h"
+#include "Parser.h"
+#include "SemanticAnalyzer.h"
+
+using namespace addNMult;
+using Clock = std::chrono::steady_clock;
+
+namespace {
+
+    struct Path {
+        const char* name;
+        bool ssa;
+        bool reuseValues;
+        int optLevel;
+    };
+
+    const Path paths[] = {
+        {"alloca",     false, false, -1},
+        {"alloca -O0", false, false, 0},
+        {"alloca -O1", false, false, 1},
+        {"alloca -O2", false, false, 2},
+        {"alloca -O3", false, false, 3},
+        {"reuse",      false, true,  -1},
+        {"reuse -O0",  false, true,  0},
+        {"reuse -O1",  false, true,  1},
+        {"reuse -O2",  false, true,  2},
+        {"reuse -O3",  false, true,  3},
+        {"ssa",        true,  false, -1},
+        {"ssa -O0",    true,  false, 0},
+        {"ssa -O1",    true,  false, 1},
+        {"ssa -O2",    true,  false, 2},
+        {"ssa -O3",    true,  false, 3},
+    };
+
+    // A JIT-ed program; the JIT has to outlive calls through the entry point.
+    struct Compiled {
+        std::unique_ptr<Jit> jit;
+        Jit::EntryPoint entry = nullptr;
+    };
+
+    Compiled compile(const std::string& source, const Path& path) {
+        Lexer lexer(source);
+        Parser parser(lexer);
+        auto program = parser.parseProgram();
+        SemanticAnalyzer analyzer;
+        if (!analyzer.analyze(*program)) return {};
+
+        CodeGenOptions options;
+        options.ssa = path.ssa;
+        options.reuseValues = path.reuseValues;
+        options.opaqueLets = true;
+        CodeGen cg("addNMult.bench", options);
+        if (!cg.emit(*program)) return {};
+
+        auto machine = createHostTargetMachine();
+        if (!machine) return {};
+        cg.module()->setTargetTriple(machine->getTargetTriple().str());
+        cg.module()->setDataLayout(machine->createDataLayout());
+        if (path.optLevel >= 0) optimize(*cg.module(), path.optLevel, machine.get());
+
+        Compiled compiled;
+        compiled.jit = Jit::create(codeGenLevel(path.optLevel));
+        if (!compiled.jit) return {};
+        auto [context, module] = cg.release();
+        compiled.entry = compiled.jit->add(std::move(context), std::move(module));
+        return compiled;
+    }
+
+    // ns/call of one round of `iterations` calls.
+    double timeRound(Jit::EntryPoint entry, std::uint64_t iterations) {
+        volatile std::int64_t sink = 0;
+        auto start = Clock::now();
+        for (std::uint64_t i = 0; i < iterations; i++) {
+            sink = sink + entry();
+        }
+        std::chrono::duration<double, std::nano> elapsed = Clock::now() - start;
+        return elapsed.count() / static_cast<double>(iterations);
+    }
+
+    bool readFile(const std::string& path, std::string& contents) {
+        std::ifstream file(path);
+        if (!file) return false;
+        std::stringstream buffer;
+        buffer << file.rdbuf();
+        contents = buffer.str();
+        return true;
+    }
+}
+
+int main(int argc, char** argv) {
+    std::uint64_t iterations = 5'000'000;
+    unsigned rounds = 10;
+    std::vector<std::string> programs;
+
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg.rfind("--iterations=", 0) == 0) {
+            iterations = std::stoull(arg.substr(std::strlen("--iterations=")));
+        } else if (arg.rfind("--rounds=", 0) == 0) {
+            rounds = std::stoul(arg.substr(std::strlen("--rounds=")));
+        } else if (!arg.empty() && arg[0] == '-') {
+            std::cerr << "usage: addnmult-bench [--iterations=N] [--rounds=N] [program.anm...]\n";
+            return 1;
+        } else {
+            programs.push_back(arg);
+        }
+    }
+    if (iterations == 0 || rounds == 0) {
+        std::cerr << "iterations and rounds must be positive\n";
+        return 1;
+    }
+
+    if (programs.empty()) {
+        for (const auto& entry : std::filesystem::directory_iterator(ADDNMULT_BENCH_CORPUS)) {
+            if (entry.path().extension() == ".anm") programs.push_back(entry.path().string());
+        }
+        std::sort(programs.begin(), programs.end());
+    }
+
+    std::cout << std::left << std::setw(20) << "program" << std::setw(12) << "path"
+              << std::right << std::setw(12) << "compile ms" << std::setw(12) << "ns/call"
+              << std::setw(10) << "stddev" << '\n';
+
+    bool ok = true;
+    for (const auto& programPath : programs) {
+        std::string source;
+        if (!readFile(programPath, source)) {
+            std::cerr << "cannot open '" << programPath << "'\n";
+            ok = false;
+            continue;
+        }
+        std::string name = std::filesystem::path(programPath).stem().string();
+
+        bool haveExpected = false;
+        std::int64_t expected = 0;
+        for (const Path& path : paths) {
+            auto start = Clock::now();
+            Compiled compiled;
+            try {
+                compiled = compile(source, path);
+            } catch (const std::exception& e) {
+                std::cerr << name << ": " << e.what() << '\n';
+            }
+            std::chrono::duration<double, std::milli> compileTime = Clock::now() - start;
+            if (!compiled.entry) {
+                std::cerr << name << " (" << path.name << "): compilation failed\n";
+                ok = false;
+                continue;
+            }
+
+            std::int64_t result = compiled.entry();
+            if (!haveExpected) {
+                expected = result;
+                haveExpected = true;
+            } else if (result != expected) {
+                std::cerr << name << " (" << path.name << "): returned " << result
+                          << ", other paths returned " << expected << '\n';
+                ok = false;
+            }
+
+            timeRound(compiled.entry, iterations / 10 + 1);
+            std::vector<double> samples;
+            for (unsigned r = 0; r < rounds; r++) {
+                samples.push_back(timeRound(compiled.entry, iterations));
+            }
+            double mean = 0;
+            for (double s : samples) mean += s;
+            mean /= samples.size();
+            double variance = 0;
+            for (double s : samples) variance += (s - mean) * (s - mean);
+            variance /= samples.size();
+
+            std::cout << std::left << std::setw(20) << name << std::setw(12) << path.name
+                      << std::right << std::fixed
+                      << std::setw(12) << std::setprecision(2) << compileTime.count()
+                      << std::setw(12) << std::setprecision(3) << mean
+                      << std::setw(10) << std::setprecision(3) << std::sqrt(variance) << '\n';
+        }
+    }
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,28 @@
+# Compile an addNMult program to ThinLTO bitcode and link it into <target>.
+#
+#   addnmult_target_sources(<target> <source> [OPTIONS <addnmult flags>...])
+#
+# The bitcode carries a module summary, so when <target> is built with
+# -flto=thin the linker can import the generated functions and inline them
+# into their C++ callers. That needs clang and an LTO-capable linker (lld).
+function(addnmult_target_sources target source)
+  cmake_parse_arguments(ARG "" "" "OPTIONS" ${ARGN})
+  get_filename_component(name "${source}" NAME_WE)
+  get_filename_component(source "${source}" ABSOLUTE)
+  set(output "${CMAKE_CURRENT_BINARY_DIR}/${name}.bc")
+
+  add_custom_command(
+    OUTPUT "${output}"
+    COMMAND addnmult ${ARG_OPTIONS} --emit=bc -o "${output}" "${source}"
+    DEPENDS addnmult "${source}"
+    COMMENT "Compiling ${name} to ThinLTO bitcode"
+    VERBATIM
+  )
+  set_source_files_properties("${output}" PROPERTIES
+    EXTERNAL_OBJECT TRUE
+    GENERATED TRUE
+  )
+  target_sources(${target} PRIVATE "${output}")
+  target_compile_options(${target} PRIVATE -flto=thin)
+  target_link_options(${target} PRIVATE -flto=thin -fuse-ld=lld)
+endfunction()
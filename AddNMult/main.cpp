@@ -1,37 +1,285 @@
+#include <cstring>
+#include <fstream>
 #include <iostream>
+#include <memory>
+#include <sstream>
 #include <string>
+#include <fcntl.h>
+#include <unistd.h>
+#include <llvm/Analysis/ModuleSummaryAnalysis.h>
+#include <llvm/ADT/Statistic.h>
+#include <llvm/Bitcode/BitcodeWriter.h>
+#include <llvm/IR/LLVMRemarkStreamer.h>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/ToolOutputFile.h>
 #include <llvm/Support/raw_ostream.h>
+#include <llvm/Target/TargetMachine.h>
+#include "Jit.h"
 #include "Lexer.h"
+#include "Optimizer.h"
 #include "Parser.h"
 #include "CodeGen.h"
 #include "SemanticAnalyzer.h"
+#include "SinglePassCompiler.h"
 
 using namespace std;
 using namespace addNMult;
 
-int main() {
+// Owns the descriptor opened for `--stream <file>`, closing it however
+// main() returns. Standard input is left open.
+struct SourceDescriptor {
+  int fd = -1;
+  SourceDescriptor() = default;
+  SourceDescriptor(const SourceDescriptor&) = delete;
+  SourceDescriptor& operator=(const SourceDescriptor&) = delete;
+  ~SourceDescriptor() {
+    if (fd >= 0 && fd != STDIN_FILENO) ::close(fd);
+  }
+};
+
+// Stamp the module with the host triple and data layout so that the bitcode
+// can be linked (and inlined) into host C++ code by the LTO linker. The
+// target machine is returned for the optimizer's cost model.
+static std::unique_ptr<llvm::TargetMachine> targetHost(llvm::Module& module) {
+  auto machine = createHostTargetMachine();
+  if (!machine) return nullptr;
+  module.setTargetTriple(machine->getTargetTriple().str());
+  module.setDataLayout(machine->createDataLayout());
+  return machine;
+}
+
+// Write textual IR, or bitcode carrying a ThinLTO module summary so the
+// linker can import and inline the generated functions into their callers.
+static bool writeModule(const llvm::Module& module, const std::string& emit,
+                        const std::string& outputPath) {
+  std::error_code ec;
+  llvm::raw_fd_ostream out(outputPath, ec,
+                           emit == "ll" ? llvm::sys::fs::OF_Text
+                                        : llvm::sys::fs::OF_None);
+  if (ec) {
+    std::cerr << "cannot open '" << outputPath << "': " << ec.message() << "\n";
+    return false;
+  }
+  if (emit == "ll") {
+    module.print(out, nullptr);
+  } else {
+    llvm::ModuleSummaryIndex index =
+        llvm::buildModuleSummaryIndex(module, nullptr, nullptr);
+    llvm::WriteBitcodeToFile(module, out, false, &index);
+  }
+  return true;
+}
+
+static void printStatistics() {
+  if (llvm::GetStatistics().empty()) {
+    std::cerr << "no statistics were collected (LLVM was built without"
+                 " statistics support)\n";
+  } else {
+    llvm::PrintStatistics(llvm::errs());
+  }
+}
+
+int main(int argc, char** argv) {
   std::string input =
     "let x = 2 + 2\n"
     "return x\n";
-  Lexer lexer(input);
-  Parser p(lexer);
-  try {
-    auto prog = p.parseProgram();
-    CodeGen cg("addNMult.cpp");
+  CodeGenOptions options;
+  std::string emit = "ll";
+  std::string outputPath = "-";
+  bool singlePass = false;
+  bool stream = false;
+  int optLevel = -1;
+  std::string remarksPath;
+  std::string remarksFormat = "yaml";
+  std::string remarksFilter;
+  bool llvmStats = false;
+  bool jit = false;
+  bool lazy = false;
+  bool debugInfo = false;
+  bool perf = false;
+  const char* path = nullptr;
+  for (int i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+    if (arg == "--ssa") {
+      options.ssa = true;
+    } else if (arg == "--reuse-values") {
+      options.reuseValues = true;
+    } else if (arg == "--single-pass") {
+      singlePass = true;
+    } else if (arg == "--stream") {
+      stream = true;
+    } else if (arg == "--profile-generate") {
+      options.profileGenerate = "addnmult.profraw";
+    } else if (arg.rfind("--profile-generate=", 0) == 0) {
+      options.profileGenerate = arg.substr(std::strlen("--profile-generate="));
+    } else if (arg.rfind("--profile-use=", 0) == 0) {
+      options.profileUse = arg.substr(std::strlen("--profile-use="));
+    } else if (arg == "-O0" || arg == "-O1" || arg == "-O2" || arg == "-O3") {
+      optLevel = arg[2] - '0';
+    } else if (arg.rfind("--remarks=", 0) == 0) {
+      remarksPath = arg.substr(std::strlen("--remarks="));
+    } else if (arg == "--remarks-format=yaml" || arg == "--remarks-format=bitstream") {
+      remarksFormat = arg.substr(std::strlen("--remarks-format="));
+    } else if (arg.rfind("--remarks-filter=", 0) == 0) {
+      remarksFilter = arg.substr(std::strlen("--remarks-filter="));
+    } else if (arg == "--llvm-stats") {
+      llvmStats = true;
+    } else if (arg == "--jit") {
+      jit = true;
+    } else if (arg == "--lazy") {
+      jit = true;
+      lazy = true;
+      options.outlineArms = true;
+    } else if (arg == "-g") {
+      debugInfo = true;
+    } else if (arg == "--perf") {
+      jit = true;
+      perf = true;
+    } else if (arg == "--emit=ll" || arg == "--emit=bc") {
+      emit = arg.substr(std::strlen("--emit="));
+    } else if (arg == "-o" && i + 1 < argc) {
+      outputPath = argv[++i];
+    } else if (!arg.empty() && arg[0] == '-') {
+      std::cerr << "unknown option '" << arg << "'\n"
+                << "usage: addnmult [--ssa] [--reuse-values] [--single-pass] [--stream]\n"
+                   "                [--profile-generate[=file]] [--profile-use=file]\n"
+                   "                [-O0|-O1|-O2|-O3] [--remarks=file]"
+                   " [--remarks-format=yaml|bitstream]\n"
+                   "                [--remarks-filter=regex] [--llvm-stats] [-g]\n"
+                   "                [--jit | --lazy | --perf | --emit=ll|bc [-o output]] [file]\n";
+      return 1;
+    } else {
+      path = argv[i];
+    }
+  }
+  if (options.outlineArms && options.ssa) {
+    std::cerr << "--lazy keeps variables in memory and cannot be combined with --ssa\n";
+    return 1;
+  }
+  // The lazy JIT copies each function it compiles into a context of its
+  // own, which has no remark streamer.
+  if (lazy && !remarksPath.empty()) {
+    std::cerr << "--lazy cannot be combined with --remarks\n";
+    return 1;
+  }
 
-    SemanticAnalyzer semanticAnalyzer;
-    if (!semanticAnalyzer.analyze(*prog)) {
-      std::cerr << "semantic analysis failed\n";
+  // Streaming reads the source through the lexer's refill buffer instead
+  // of slurping it into a string first.
+  // Declared first so the lexer is gone before the descriptor is closed.
+  SourceDescriptor source;
+  std::unique_ptr<Lexer> lexer;
+  if (stream) {
+    source.fd = path ? ::open(path, O_RDONLY) : STDIN_FILENO;
+    if (source.fd < 0) {
+      std::cerr << "cannot open '" << path << "'\n";
       return 1;
     }
+    lexer = std::make_unique<Lexer>(source.fd);
+  } else {
+    if (path) {
+      std::ifstream file(path);
+      if (!file) {
+        std::cerr << "cannot open '" << path << "'\n";
+        return 1;
+      }
+      std::stringstream contents;
+      contents << file.rdbuf();
+      input = contents.str();
+    }
+    lexer = std::make_unique<Lexer>(input);
+  }
+
+  try {
+    CodeGen cg("addNMult.cpp", options);
+    llvm::Function* mainFunction = nullptr;
+
+    // Remarks and profiles point at source lines, so the IR needs
+    // locations; the lexer's line table turns token offsets into them.
+    // Profiling the JIT'd code gets full debug info, as with -g.
+    if (perf) debugInfo = true;
+    if (debugInfo || !remarksPath.empty()) {
+      lexer->trackLines();
+      cg.setSource(path ? path : stream ? "<stdin>" : "<builtin>", lexer->lines(),
+                   debugInfo);
+    }
+    std::unique_ptr<llvm::ToolOutputFile> remarksFile;
+    if (!remarksPath.empty()) {
+      auto file = llvm::setupLLVMOptimizationRemarks(
+          cg.context(), remarksPath, remarksFilter, remarksFormat, false);
+      if (!file) {
+        std::cerr << "cannot write remarks: " << llvm::toString(file.takeError()) << "\n";
+        return 1;
+      }
+      remarksFile = std::move(*file);
+    }
+
+    if (singlePass) {
+      SinglePassCompiler compiler(*lexer, cg);
+      mainFunction = compiler.compile();
+    } else if (stream) {
+      // Each top-level statement is checked and emitted as soon as it has
+      // been parsed, and its AST is freed before the next one is read.
+      Parser p(*lexer);
+      SemanticAnalyzer semanticAnalyzer;
+      semanticAnalyzer.begin();
+      if (cg.begin()) {
+        bool emitted = true;
+        while (auto statement = p.parseTopLevel()) {
+          lexer->forgetLinesBefore(statement->offset);
+          if (!semanticAnalyzer.analyzeStatement(statement.get())) {
+            std::cerr << "semantic analysis failed\n";
+            return 1;
+          }
+          if (!cg.emitStatement(statement.get())) {
+            emitted = false;
+            break;
+          }
+        }
+        if (emitted) {
+          mainFunction = cg.finish();
+        } else {
+          cg.discard();
+        }
+      }
+    } else {
+      Parser p(*lexer);
+      auto prog = p.parseProgram();
 
-    auto* mainFunction = cg.emit(*prog);
+      SemanticAnalyzer semanticAnalyzer;
+      if (!semanticAnalyzer.analyze(*prog)) {
+        std::cerr << "semantic analysis failed\n";
+        return 1;
+      }
+
+      mainFunction = cg.emit(*prog);
+    }
     if (!mainFunction) {
       std::cerr << "codegen failed\n";
       return 1;
     }
-    cg.module()->print(llvm::outs(), nullptr);
-    return 0;
+    auto machine = targetHost(*cg.module());
+    if (!machine) return 1;
+
+    // A lazy JIT optimizes each function when it first compiles it, so
+    // its statistics are only complete once the program has run.
+    if (llvmStats) llvm::EnableStatistics(false);
+    if (optLevel >= 0 && !lazy) optimize(*cg.module(), optLevel, machine.get());
+    if (remarksFile) remarksFile->keep();
+    if (llvmStats && !lazy) printStatistics();
+
+    if (jit) {
+      auto engine = Jit::create(codeGenLevel(optLevel), perf, lazy);
+      if (!engine) return 1;
+      if (optLevel >= 0 && lazy) engine->optimizeOnCompile(optLevel);
+      auto [context, module] = cg.release();
+      Jit::EntryPoint entry = engine->add(std::move(context), std::move(module));
+      if (!entry) return 1;
+      std::cout << entry() << '\n';
+      if (llvmStats && lazy) printStatistics();
+      return 0;
+    }
+
+    return writeModule(*cg.module(), emit, outputPath) ? 0 : 1;
   } catch (const std::exception& e) {
     std::cerr << "error: " << e.what() << std::endl;
     return 1;